@@ -0,0 +1,303 @@
+#include "BroadcastEngine.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cstring>
+#include <algorithm>
+
+BroadcastEngine::BroadcastEngine(int flushThreads, size_t maxQueuedMessages, SlowConsumerPolicy policy)
+	// coalescing keeps the front message, which may be half sent, next to the latest one
+	: maxQueuedMessages(std::max<size_t>(maxQueuedMessages, policy == SlowConsumerPolicy::Coalesce ? 2 : 1)), policy(policy), lastGeneration(0), droppedMessages(0),
+	  disconnectedClients(0), halted(false), epfd(-1), wakefd(-1), flushers(std::max(flushThreads, 1))
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+	{
+		std::string err(strerror(errno));
+		throw BroadcastEngineException("epoll_create1 error: " + err);
+	}
+	wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0;
+	if (wakefd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0)
+	{
+		std::string err(strerror(errno));
+		if (wakefd >= 0)
+			close(wakefd);
+		close(epfd);
+		throw BroadcastEngineException("eventfd error: " + err);
+	}
+	poller = std::thread([this] { PollLoop(); });
+}
+
+BroadcastEngine::~BroadcastEngine()
+{
+	Stop();
+	// removes the remaining registrations and reservations
+	Clear();
+	close(wakefd);
+	close(epfd);
+}
+
+void BroadcastEngine::Add(std::shared_ptr<Socket> client)
+{
+	if (client->GetSocket() < 0)
+		return;
+	std::lock_guard<std::mutex> lock(_queues);
+	std::shared_ptr<ClientQueue> &queue = queues[client.get()];
+	if (!queue)
+		queue = std::make_shared<ClientQueue>(client, ++lastGeneration);
+}
+
+void BroadcastEngine::Remove(const std::shared_ptr<Socket> &client)
+{
+	std::shared_ptr<ClientQueue> queue;
+	{
+		std::lock_guard<std::mutex> lock(_queues);
+		auto it = queues.find(client.get());
+		if (it == queues.end())
+			return;
+		queue = it->second;
+		queues.erase(it);
+	}
+	std::lock_guard<std::mutex> lock(queue->mtx);
+	Close(*queue);
+}
+
+void BroadcastEngine::Clear()
+{
+	std::unordered_map<Socket *, std::shared_ptr<ClientQueue>> removed;
+	{
+		std::lock_guard<std::mutex> lock(_queues);
+		removed.swap(queues);
+	}
+	for (auto &entry : removed)
+	{
+		std::lock_guard<std::mutex> lock(entry.second->mtx);
+		Close(*entry.second);
+	}
+}
+
+void BroadcastEngine::Broadcast(Payload payload, const std::shared_ptr<Socket> &except)
+{
+	std::vector<std::shared_ptr<ClientQueue>> recipients;
+	{
+		std::lock_guard<std::mutex> lock(_queues);
+		recipients.reserve(queues.size());
+		for (auto &entry : queues)
+		{
+			if (entry.second->socket != except)
+				recipients.push_back(entry.second);
+		}
+	}
+	for (auto &queue : recipients)
+		Enqueue(queue, payload);
+}
+
+size_t BroadcastEngine::GetDroppedMessages()
+{
+	return droppedMessages.load();
+}
+
+size_t BroadcastEngine::GetDisconnectedClients()
+{
+	return disconnectedClients.load();
+}
+
+void BroadcastEngine::Stop()
+{
+	if (halted.exchange(true))
+		return;
+	uint64_t one = 1;
+	if (write(wakefd, &one, sizeof(one)) < 0)
+	{
+		// the counter is already non-zero, the poller wakes up anyway
+	}
+	poller.join();
+	flushers.Shutdown();
+}
+
+void BroadcastEngine::Enqueue(const std::shared_ptr<ClientQueue> &queue, const Payload &payload)
+{
+	std::unique_lock<std::mutex> lock(queue->mtx);
+	if (queue->closed)
+		return;
+	if (queue->messages.size() >= maxQueuedMessages)
+	{
+		switch (policy)
+		{
+		case SlowConsumerPolicy::Drop:
+			++droppedMessages;
+			return;
+		case SlowConsumerPolicy::Disconnect:
+			++disconnectedClients;
+			droppedMessages += queue->messages.size() + 1;
+			Close(*queue);
+			lock.unlock();
+			try
+			{
+				// the handler of the connection notices and disconnects it from the server
+				queue->socket->Shutdown();
+			}
+			catch (SocketException &e)
+			{
+			}
+			return;
+		case SlowConsumerPolicy::Coalesce:
+			// the front message may be half sent, it stays
+			droppedMessages += queue->messages.size() - 1;
+			queue->messages.resize(1);
+			break;
+		}
+	}
+	queue->messages.push_back(payload);
+	if (queue->flushing || queue->waiting || halted.load())
+		return;
+	queue->flushing = true;
+	lock.unlock();
+	flushers.SubmitTask([this, queue] { Flush(queue); });
+}
+
+void BroadcastEngine::Flush(std::shared_ptr<ClientQueue> queue)
+{
+	for (;;)
+	{
+		Payload message;
+		size_t offset;
+		{
+			std::lock_guard<std::mutex> lock(queue->mtx);
+			if (queue->closed || queue->messages.empty())
+			{
+				queue->flushing = false;
+				return;
+			}
+			message = queue->messages.front();
+			offset = queue->offset;
+		}
+
+		// only this task sends on the queue, the front message and offset cannot change meanwhile.
+		// Nothing else is sent on the socket until the message is finished
+		size_t n = 0;
+		bool failed = false;
+		if (offset < message->size())
+		{
+			try
+			{
+				n = queue->socket->TrySendMessage(message->data() + offset, message->size() - offset);
+			}
+			catch (SocketException &e)
+			{
+				failed = true;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(queue->mtx);
+		if (failed || queue->closed)
+		{
+			// the connection is gone, its handler disconnects it from the server
+			Close(*queue);
+			queue->flushing = false;
+			return;
+		}
+		if (offset < message->size() && n == 0)
+		{
+			// the socket buffer is full or a blocking send is in progress, the epoll thread resumes flushing
+			// once the socket is writable
+			queue->flushing = false;
+			WaitWritable(queue);
+			return;
+		}
+		queue->offset += n;
+		if (queue->offset >= message->size())
+		{
+			queue->messages.pop_front();
+			queue->offset = 0;
+		}
+	}
+}
+
+void BroadcastEngine::WaitWritable(const std::shared_ptr<ClientQueue> &queue)
+{
+	if (queue->closed)
+		return;
+	struct epoll_event ev;
+	ev.events = EPOLLOUT | EPOLLONESHOT;
+	ev.data.u64 = queue->generation;
+	int op = EPOLL_CTL_MOD;
+	if (queue->pollfd < 0)
+	{
+		queue->pollfd = queue->socket->Duplicate();
+		if (queue->pollfd < 0)
+		{
+			Close(*queue);
+			return;
+		}
+		// known before the first event can arrive
+		std::lock_guard<std::mutex> lock(_queues);
+		pollers[queue->generation] = queue;
+		op = EPOLL_CTL_ADD;
+	}
+	if (epoll_ctl(epfd, op, queue->pollfd, &ev) < 0)
+	{
+		Close(*queue);
+		return;
+	}
+	queue->waiting = true;
+}
+
+void BroadcastEngine::Close(ClientQueue &queue)
+{
+	if (queue.closed)
+		return;
+	queue.closed = true;
+	queue.messages.clear();
+	// the rest of a half sent message is not coming, the connection's own sends go on
+	queue.socket->ReleaseMessage();
+	if (queue.pollfd >= 0)
+	{
+		// the copy is still open, so the registration removed is the one of this queue
+		epoll_ctl(epfd, EPOLL_CTL_DEL, queue.pollfd, nullptr);
+		close(queue.pollfd);
+		queue.pollfd = -1;
+		std::lock_guard<std::mutex> lock(_queues);
+		pollers.erase(queue.generation);
+	}
+}
+
+void BroadcastEngine::PollLoop()
+{
+	struct epoll_event events[maxEvents];
+	while (!halted.load())
+	{
+		int n = epoll_wait(epfd, events, maxEvents, -1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (int i = 0; i < n; ++i)
+		{
+			if (events[i].data.u64 == 0)
+				continue;
+			std::shared_ptr<ClientQueue> queue;
+			{
+				std::lock_guard<std::mutex> lock(_queues);
+				auto it = pollers.find(events[i].data.u64);
+				if (it == pollers.end())
+					continue;
+				queue = it->second;
+			}
+			{
+				// the oneshot registration stays in epoll disarmed, the next WaitWritable modifies it
+				std::lock_guard<std::mutex> lock(queue->mtx);
+				if (queue->closed || !queue->waiting)
+					continue;
+				queue->waiting = false;
+				queue->flushing = true;
+			}
+			flushers.SubmitTask([this, queue] { Flush(queue); });
+		}
+	}
+}
\ No newline at end of file
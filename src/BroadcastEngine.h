@@ -0,0 +1,118 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include "Socket.h"
+#include "ThreadPool.h"
+#include "NanoException.h"
+
+/// What happens when a client has maxQueuedMessages broadcasts waiting
+enum class SlowConsumerPolicy
+{
+	/// The new message is not queued for the client
+	Drop,
+	/// The client connection is shut down
+	Disconnect,
+	/// Queued messages which have not started sending are replaced by the new one,
+	/// for state-like updates where only the latest one matters. Needs room for two messages, the front one
+	/// which may be half sent and the latest one
+	Coalesce
+};
+
+/// Fans messages out to many clients without blocking the caller. Every message is one immutable refcounted
+/// buffer shared by all per-client queues. Queues are flushed with non-blocking sends by a small thread pool,
+/// clients whose socket buffer is full are handed to an epoll thread until they become writable again, so a
+/// slow client delays nobody else. A partly sent message reserves the socket (see Socket::TrySendMessage),
+/// blocking sends of the connection's own handler go before or after it, never into it
+class BroadcastEngine
+{
+public:
+	typedef std::shared_ptr<const std::vector<uint8_t>> Payload;
+
+	/// Creates engine with flushThreads flushing workers, at most maxQueuedMessages messages wait per client.
+	/// Coalesce raises maxQueuedMessages to at least 2
+	BroadcastEngine(int flushThreads, size_t maxQueuedMessages, SlowConsumerPolicy policy);
+	~BroadcastEngine();
+
+	/// Registers client, only registered clients receive broadcasts
+	void Add(std::shared_ptr<Socket> client);
+
+	/// Unregisters client and drops its queued messages
+	void Remove(const std::shared_ptr<Socket> &client);
+
+	/// Unregisters all clients
+	void Clear();
+
+	/// Queues payload for all registered clients except the provided one (may be nullptr)
+	void Broadcast(Payload payload, const std::shared_ptr<Socket> &except);
+
+	/// Gets the number of messages which were dropped or replaced for slow clients
+	size_t GetDroppedMessages();
+
+	/// Gets the number of clients which were disconnected for being too slow
+	size_t GetDisconnectedClients();
+
+	/// Stops flushing, called by the destructor
+	void Stop();
+
+private:
+	struct ClientQueue
+	{
+		std::shared_ptr<Socket> socket;
+		std::mutex mtx;
+		std::deque<Payload> messages;
+		/// Bytes of the front message which were already sent
+		size_t offset;
+		/// A flush task owns the queue
+		bool flushing;
+		/// The queue waits in epoll for the socket to become writable
+		bool waiting;
+		/// Copy of the descriptor registered in epoll, owned by the engine so that the registration is removed
+		/// before the number can be reused. Added by the first wait, later waits modify the registration
+		int pollfd;
+		/// Tags the epoll registration, events of a registration removed meanwhile find no queue
+		uint64_t generation;
+		bool closed;
+		ClientQueue(std::shared_ptr<Socket> socket, uint64_t generation)
+			: socket(socket), offset(0), flushing(false), waiting(false), pollfd(-1), generation(generation), closed(false) {}
+	};
+
+	size_t maxQueuedMessages;
+	SlowConsumerPolicy policy;
+	std::unordered_map<Socket *, std::shared_ptr<ClientQueue>> queues;
+	/// Queues registered in epoll by generation
+	std::unordered_map<uint64_t, std::shared_ptr<ClientQueue>> pollers;
+	/// 0 tags the wakeup eventfd
+	uint64_t lastGeneration;
+	std::mutex _queues;
+	std::atomic<size_t> droppedMessages;
+	std::atomic<size_t> disconnectedClients;
+	std::atomic<bool> halted;
+	int epfd;
+	int wakefd;
+	std::thread poller;
+	ThreadPool flushers;
+
+	static const int maxEvents = 128;
+
+	void Enqueue(const std::shared_ptr<ClientQueue> &queue, const Payload &payload);
+
+	void Flush(std::shared_ptr<ClientQueue> queue);
+
+	void WaitWritable(const std::shared_ptr<ClientQueue> &queue);
+
+	void Close(ClientQueue &queue);
+
+	void PollLoop();
+};
+
+class BroadcastEngineException : public NanoException
+{
+public:
+	BroadcastEngineException(std::string msg) : NanoException(msg) {}
+};
\ No newline at end of file
@@ -0,0 +1,123 @@
+#include "ClientRegistry.h"
+
+ClientRegistry::ClientRegistry() : size(0)
+{
+}
+
+bool ClientRegistry::Add(std::shared_ptr<Socket> client)
+{
+	int fd = client->GetSocket();
+	if (fd < 0)
+		return false;
+	Shard &shard = shards[fd % shardCount];
+	size_t index = fd / shardCount;
+	std::shared_ptr<Socket> replaced;
+	{
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		if (index >= shard.slots.size())
+			shard.slots.resize(index + 1);
+		std::shared_ptr<Socket> &slot = shard.slots[index];
+		if (slot == client)
+			return true;
+		// the occupant was closed while registered and the process reused its descriptor, it is gone for good
+		if (slot && slot->GetSocket() == fd)
+			return false;
+		if (!slot)
+			++size;
+		replaced.swap(slot);
+		slot = std::move(client);
+	}
+	return true;
+}
+
+bool ClientRegistry::Remove(const std::shared_ptr<Socket> &client)
+{
+	int fd = client->GetSocket();
+	if (fd < 0)
+		return RemoveClosed(client);
+	// the registry holds a reference, so the descriptor is not reused by another client while registered
+	Shard &shard = shards[fd % shardCount];
+	size_t index = fd / shardCount;
+	std::shared_ptr<Socket> removed;
+	{
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		if (index >= shard.slots.size() || shard.slots[index] != client)
+			return false;
+		removed.swap(shard.slots[index]);
+		--size;
+	}
+	return true;
+}
+
+bool ClientRegistry::RemoveClosed(const std::shared_ptr<Socket> &client)
+{
+	// the socket was closed without leaving the registry, its slot is not known anymore
+	for (Shard &shard : shards)
+	{
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		for (auto &slot : shard.slots)
+		{
+			if (slot == client)
+			{
+				slot.reset();
+				--size;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+std::vector<std::shared_ptr<Socket>> ClientRegistry::Snapshot() const
+{
+	// all shards are locked in the same order, so the snapshot sees no add or remove half done
+	std::vector<std::unique_lock<std::mutex>> locks;
+	locks.reserve(shardCount);
+	for (const Shard &shard : shards)
+		locks.emplace_back(shard.mtx);
+
+	std::vector<std::shared_ptr<Socket>> clients;
+	clients.reserve(size.load());
+	for (const Shard &shard : shards)
+	{
+		for (auto &slot : shard.slots)
+		{
+			if (slot)
+				clients.push_back(slot);
+		}
+	}
+	return clients;
+}
+
+size_t ClientRegistry::Size() const
+{
+	// a client closed without leaving the registry still holds its slot until it is removed
+	size_t open = 0;
+	for (const Shard &shard : shards)
+	{
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		for (auto &slot : shard.slots)
+		{
+			if (slot && slot->GetSocket() >= 0)
+				++open;
+		}
+	}
+	return open;
+}
+
+void ClientRegistry::Clear()
+{
+	for (Shard &shard : shards)
+	{
+		std::vector<std::shared_ptr<Socket>> slots;
+		{
+			std::lock_guard<std::mutex> lock(shard.mtx);
+			for (auto &slot : shard.slots)
+			{
+				if (slot)
+					--size;
+			}
+			slots.swap(shard.slots);
+		}
+	}
+}
\ No newline at end of file
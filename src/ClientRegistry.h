@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstddef>
+#include "Socket.h"
+
+/// Set of connected client sockets indexed by file descriptor. Sockets are spread over shards by descriptor,
+/// each shard keeps a slot per descriptor, so that adding and removing a client is O(1) and only contends
+/// with clients of the same shard
+class ClientRegistry
+{
+public:
+	ClientRegistry();
+
+	/// Adds client socket. A closed socket still holding the slot of the descriptor is replaced, returns false
+	/// when another open socket already holds it or client is closed
+	bool Add(std::shared_ptr<Socket> client);
+
+	/// Removes client socket, returns false when it is not registered
+	bool Remove(const std::shared_ptr<Socket> &client);
+
+	/// Gets all registered clients at one point in time
+	std::vector<std::shared_ptr<Socket>> Snapshot() const;
+
+	/// Gets the number of registered clients which are still open
+	size_t Size() const;
+
+	/// Removes all clients
+	void Clear();
+
+private:
+	static const size_t shardCount = 64;
+
+	struct Shard
+	{
+		mutable std::mutex mtx;
+		/// Slot fd / shardCount holds the client with descriptor fd
+		std::vector<std::shared_ptr<Socket>> slots;
+		/// Shards are written by different threads, keep them on separate cache lines
+		char pad[64];
+	};
+
+	Shard shards[shardCount];
+	std::atomic<size_t> size;
+
+	bool RemoveClosed(const std::shared_ptr<Socket> &client);
+};
\ No newline at end of file
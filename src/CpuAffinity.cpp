@@ -0,0 +1,106 @@
+#include "CpuAffinity.h"
+#include <sched.h>
+#include <dirent.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+
+std::vector<int> CpuAffinity::GetAllowedCpus()
+{
+	std::vector<int> cpus;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+	{
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		{
+			if (CPU_ISSET(cpu, &set))
+				cpus.push_back(cpu);
+		}
+	}
+	return cpus;
+}
+
+std::vector<std::vector<int>> CpuAffinity::GetNumaNodes()
+{
+	auto allowed = GetAllowedCpus();
+	std::vector<std::pair<int, std::vector<int>>> nodes;
+	DIR *dir = opendir("/sys/devices/system/node");
+	if (dir)
+	{
+		struct dirent *entry;
+		while ((entry = readdir(dir)) != nullptr)
+		{
+			if (strncmp(entry->d_name, "node", 4) != 0 || !isdigit((unsigned char)entry->d_name[4]))
+				continue;
+			std::ifstream file(std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist");
+			std::string list;
+			if (!std::getline(file, list))
+				continue;
+			// only cpus the process may use, memory-only nodes end up empty
+			std::vector<int> cpus;
+			for (int cpu : ParseCpuList(list))
+			{
+				if (std::binary_search(allowed.begin(), allowed.end(), cpu))
+					cpus.push_back(cpu);
+			}
+			if (!cpus.empty())
+				nodes.emplace_back(atoi(entry->d_name + 4), cpus);
+		}
+		closedir(dir);
+	}
+	std::sort(nodes.begin(), nodes.end());
+
+	std::vector<std::vector<int>> result;
+	for (auto &node : nodes)
+		result.push_back(node.second);
+	if (result.empty() && !allowed.empty())
+		result.push_back(allowed);
+	return result;
+}
+
+std::vector<int> CpuAffinity::ParseCpuList(const std::string &list)
+{
+	std::vector<int> cpus;
+	std::stringstream ss(list);
+	std::string range;
+	while (std::getline(ss, range, ','))
+	{
+		if (range.empty() || !isdigit((unsigned char)range[0]))
+			continue;
+		size_t dash = range.find('-');
+		int first = atoi(range.c_str());
+		int last = dash == std::string::npos ? first : atoi(range.c_str() + dash + 1);
+		for (int cpu = first; cpu <= last; ++cpu)
+			cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+bool CpuAffinity::PinCurrentThread(int cpu)
+{
+	return PinThread(pthread_self(), std::vector<int>(1, cpu));
+}
+
+bool CpuAffinity::PinCurrentThread(const std::vector<int> &cpus)
+{
+	return PinThread(pthread_self(), cpus);
+}
+
+bool CpuAffinity::PinThread(pthread_t thread, const std::vector<int> &cpus)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus)
+	{
+		if (cpu < 0 || cpu >= CPU_SETSIZE)
+			return false;
+		CPU_SET(cpu, &set);
+	}
+	if (CPU_COUNT(&set) == 0)
+		return false;
+	return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
\ No newline at end of file
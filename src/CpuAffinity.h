@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <pthread.h>
+
+/// Helpers for binding threads to cpus
+class CpuAffinity
+{
+public:
+	/// Gets ids of the cpus which the process is allowed to run on
+	static std::vector<int> GetAllowedCpus();
+
+	/// Gets allowed cpus grouped by NUMA node (from /sys/devices/system/node).
+	/// Machines without NUMA information are reported as a single node
+	static std::vector<std::vector<int>> GetNumaNodes();
+
+	/// Parses cpu list in the kernel format, e.g. "0-3,8,10-11"
+	static std::vector<int> ParseCpuList(const std::string &list);
+
+	/// Pins the calling thread to the cpu, returns false when it is not possible
+	static bool PinCurrentThread(int cpu);
+
+	/// Pins the calling thread to the set of cpus, returns false when it is not possible
+	static bool PinCurrentThread(const std::vector<int> &cpus);
+
+	/// Pins another thread to the set of cpus, returns false when it is not possible
+	static bool PinThread(pthread_t thread, const std::vector<int> &cpus);
+};
\ No newline at end of file
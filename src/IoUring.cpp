@@ -0,0 +1,441 @@
+#include "IoUring.h"
+#include <errno.h>
+#include <string.h>
+
+#ifndef SOCKNANO_NO_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+
+static const uint64_t requestUserData = 1;
+static const uint64_t timeoutUserData = 2;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool ProbeKernel()
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = io_uring_setup(2, &p);
+    if (fd < 0)
+        return false;
+
+    const unsigned nrOps = 256;
+    std::vector<uint8_t> mem(sizeof(struct io_uring_probe) + nrOps * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe *probe = (struct io_uring_probe *)mem.data();
+    bool supported = io_uring_register(fd, IORING_REGISTER_PROBE, probe, nrOps) == 0;
+    const int required[] = {IORING_OP_SEND, IORING_OP_RECV, IORING_OP_ACCEPT, IORING_OP_LINK_TIMEOUT};
+    for (int op : required)
+    {
+        supported = supported && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+    close(fd);
+    return supported;
+}
+
+IoUring::IoUring(unsigned entries, unsigned cqEntries)
+    : ringFd(-1), sqPtr(MAP_FAILED), cqPtr(MAP_FAILED), sqes(MAP_FAILED), sqeHead(0), sqeTail(0),
+      bufRing(MAP_FAILED), buffers((uint8_t *)MAP_FAILED), bufSize(0), bufCount(0), bufTail(0)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if (cqEntries > 0)
+    {
+        p.flags |= IORING_SETUP_CQSIZE;
+        p.cq_entries = cqEntries;
+    }
+    ringFd = io_uring_setup(entries, &p);
+    if (ringFd < 0)
+    {
+        std::string err(strerror(errno));
+        throw IoUringException("io_uring_setup error: " + err);
+    }
+
+    sqEntries = p.sq_entries;
+    sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap)
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+    sqPtr = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqPtr != MAP_FAILED)
+        cqPtr = singleMmap ? sqPtr : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (cqPtr != MAP_FAILED)
+        sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        std::string err(strerror(errno));
+        Release();
+        throw IoUringException("mmap error: " + err);
+    }
+
+    uint8_t *sq = (uint8_t *)sqPtr;
+    sqHead = (unsigned *)(sq + p.sq_off.head);
+    sqTail = (unsigned *)(sq + p.sq_off.tail);
+    sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + p.sq_off.array);
+
+    uint8_t *cq = (uint8_t *)cqPtr;
+    cqHead = (unsigned *)(cq + p.cq_off.head);
+    cqTail = (unsigned *)(cq + p.cq_off.tail);
+    cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = cq + p.cq_off.cqes;
+}
+
+IoUring::~IoUring()
+{
+    Release();
+}
+
+bool IoUring::IsSupported()
+{
+    static const bool supported = ProbeKernel();
+    return supported;
+}
+
+void IoUring::RegisterFiles(const int *fds, unsigned count)
+{
+    if (io_uring_register(ringFd, IORING_REGISTER_FILES, fds, count) < 0)
+    {
+        std::string err(strerror(errno));
+        throw IoUringException("io_uring_register error: " + err);
+    }
+}
+
+void IoUring::PrepareSend(int fd, const void *buf, size_t len, int flags)
+{
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)GetSqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = flags;
+    sqe->user_data = requestUserData;
+}
+
+void IoUring::PrepareRecv(int fd, void *buf, size_t len, int flags)
+{
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)GetSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = flags;
+    sqe->user_data = requestUserData;
+}
+
+void IoUring::PrepareAccept(int fd)
+{
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)GetSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->user_data = requestUserData;
+}
+
+void IoUring::SetupBufferRing(uint16_t bgid, unsigned count, size_t bufSize)
+{
+    bufRingSize = count * sizeof(struct io_uring_buf);
+    bufRing = mmap(nullptr, bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buffersSize = count * bufSize;
+    if (bufRing != MAP_FAILED)
+        buffers = (uint8_t *)mmap(nullptr, buffersSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (buffers == MAP_FAILED)
+    {
+        std::string err(strerror(errno));
+        throw IoUringException("mmap error: " + err);
+    }
+
+    // ring starts empty, buffers are published by moving the tail
+    memset(bufRing, 0, bufRingSize);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)bufRing;
+    reg.ring_entries = count;
+    reg.bgid = bgid;
+    if (io_uring_register(ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        std::string err(strerror(errno));
+        throw IoUringException("io_uring_register error: " + err);
+    }
+
+    this->bufSize = bufSize;
+    bufCount = count;
+    bufTail = 0;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        RecycleBuffer(i);
+    }
+}
+
+void IoUring::RecycleBuffer(uint16_t bid)
+{
+    // bufs is a flexible array member which C++ may place at a different offset, index the ring directly
+    struct io_uring_buf_ring *br = (struct io_uring_buf_ring *)bufRing;
+    struct io_uring_buf *buf = (struct io_uring_buf *)bufRing + (bufTail & (bufCount - 1));
+    buf->addr = (uint64_t)(uintptr_t)(buffers + (size_t)bid * bufSize);
+    buf->len = bufSize;
+    buf->bid = bid;
+    ++bufTail;
+    __atomic_store_n(&br->tail, bufTail, __ATOMIC_RELEASE);
+}
+
+void IoUring::PrepareRecvMsgMultishot(int fileIndex, uint16_t bgid, size_t controlLen, uint64_t userData)
+{
+    memset(&multishotMsg, 0, sizeof(multishotMsg));
+    multishotMsg.msg_namelen = sizeof(struct sockaddr_in);
+    multishotMsg.msg_controllen = controlLen;
+
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)GetSqe();
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->fd = fileIndex;
+    sqe->addr = (uint64_t)(uintptr_t)&multishotMsg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = bgid;
+    sqe->user_data = userData;
+}
+
+bool IoUring::ParseRecvMsg(const IoUringCompletion &completion, IoUringRecvMsg *msg, uint16_t *bid)
+{
+    if (!(completion.flags & IORING_CQE_F_BUFFER))
+        return false;
+    *bid = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+    if (completion.res < 0)
+        return true;
+
+    const uint8_t *buf = buffers + (size_t)*bid * bufSize;
+    const struct io_uring_recvmsg_out *out = (const struct io_uring_recvmsg_out *)buf;
+    size_t nameOffset = sizeof(*out);
+    size_t controlOffset = nameOffset + multishotMsg.msg_namelen;
+    size_t payloadOffset = controlOffset + multishotMsg.msg_controllen;
+    size_t received = completion.res;
+
+    msg->address = out->namelen >= sizeof(struct sockaddr_in) ? (const struct sockaddr_in *)(buf + nameOffset) : nullptr;
+    msg->control = buf + controlOffset;
+    msg->controlLen = std::min<size_t>(out->controllen, multishotMsg.msg_controllen);
+    msg->payload = buf + payloadOffset;
+    msg->payloadLen = received > payloadOffset ? std::min<size_t>(out->payloadlen, received - payloadOffset) : 0;
+    msg->truncated = out->flags & MSG_TRUNC;
+    return true;
+}
+
+bool IoUring::HasMore(const IoUringCompletion &completion)
+{
+    return completion.flags & IORING_CQE_F_MORE;
+}
+
+int IoUring::Run(int timeout)
+{
+    unsigned expected = 1;
+    struct __kernel_timespec ts;
+    if (timeout > 0)
+    {
+        struct io_uring_sqe *sqe = (struct io_uring_sqe *)sqes + ((sqeTail - 1) & *sqMask);
+        sqe->flags |= IOSQE_IO_LINK;
+
+        ts.tv_sec = timeout;
+        ts.tv_nsec = 0;
+        struct io_uring_sqe *tsqe = (struct io_uring_sqe *)GetSqe();
+        tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+        tsqe->addr = (uint64_t)(uintptr_t)&ts;
+        tsqe->len = 1;
+        tsqe->user_data = timeoutUserData;
+        expected = 2;
+    }
+
+    int ret = Submit(expected);
+    bool timedOut = false;
+    int result = -ECANCELED;
+    while (expected > 0)
+    {
+        IoUringCompletion completion;
+        if (!PopCompletion(&completion))
+        {
+            if (ret < 0 && ret != -EINTR)
+            {
+                Abandon(expected);
+                return ret;
+            }
+            ret = Submit(1);
+            continue;
+        }
+        if (completion.userData == requestUserData)
+            result = completion.res;
+        else if (completion.res == -ETIME)
+            timedOut = true;
+        --expected;
+    }
+    if (timedOut && result == -ECANCELED)
+        return -ETIME;
+    return result;
+}
+
+int IoUring::GetRingFd()
+{
+    return ringFd;
+}
+
+void IoUring::Abandon(unsigned expected)
+{
+    // without SQPOLL the kernel reads submissions only in io_uring_enter, the ones it has not consumed are taken back
+    unsigned tail = *sqTail;
+    unsigned unconsumed = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    __atomic_store_n(sqTail, tail - unconsumed, __ATOMIC_RELEASE);
+    sqeHead -= unconsumed;
+    sqeTail -= unconsumed;
+    expected -= std::min(expected, unconsumed);
+
+    // consumed requests are waited for, their completions would be taken for the result of a later Run
+    while (expected > 0)
+    {
+        IoUringCompletion completion;
+        if (PopCompletion(&completion))
+        {
+            --expected;
+            continue;
+        }
+        if (io_uring_enter(ringFd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+        {
+            // the ring can't be waited on, closing it cancels what is left
+            Release();
+            return;
+        }
+    }
+}
+
+void *IoUring::GetSqe()
+{
+    if (ringFd < 0)
+        throw IoUringException("io_uring error: Ring has been closed");
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (sqeTail - head >= sqEntries)
+        throw IoUringException("io_uring error: Submission queue is full");
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)sqes + (sqeTail & *sqMask);
+    ++sqeTail;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int IoUring::Submit(unsigned waitNr)
+{
+    unsigned tail = *sqTail;
+    while (sqeHead != sqeTail)
+    {
+        sqArray[tail & *sqMask] = sqeHead & *sqMask;
+        ++tail;
+        ++sqeHead;
+    }
+    __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+    unsigned toSubmit = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    int ret = io_uring_enter(ringFd, toSubmit, waitNr, waitNr > 0 ? IORING_ENTER_GETEVENTS : 0);
+    return ret < 0 ? -errno : ret;
+}
+
+bool IoUring::PopCompletion(IoUringCompletion *completion)
+{
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        return false;
+    struct io_uring_cqe *cqe = (struct io_uring_cqe *)cqes + (head & *cqMask);
+    completion->userData = cqe->user_data;
+    completion->res = cqe->res;
+    completion->flags = cqe->flags;
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void IoUring::Release()
+{
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqesSize);
+    if (cqPtr != MAP_FAILED && cqPtr != sqPtr)
+        munmap(cqPtr, cqRingSize);
+    if (sqPtr != MAP_FAILED)
+        munmap(sqPtr, sqRingSize);
+    if (ringFd >= 0)
+        close(ringFd);
+    // provided buffers may be used by the kernel until the ring is closed
+    if (buffers != MAP_FAILED)
+        munmap(buffers, buffersSize);
+    if (bufRing != MAP_FAILED)
+        munmap(bufRing, bufRingSize);
+    sqes = cqPtr = sqPtr = bufRing = MAP_FAILED;
+    buffers = (uint8_t *)MAP_FAILED;
+    ringFd = -1;
+}
+
+#else
+
+IoUring::IoUring(unsigned, unsigned)
+{
+    throw IoUringException("io_uring error: Library has been built without io_uring support");
+}
+
+IoUring::~IoUring() {}
+
+bool IoUring::IsSupported()
+{
+    return false;
+}
+
+void IoUring::RegisterFiles(const int *, unsigned) {}
+void IoUring::PrepareSend(int, const void *, size_t, int) {}
+void IoUring::PrepareRecv(int, void *, size_t, int) {}
+void IoUring::PrepareAccept(int) {}
+void IoUring::SetupBufferRing(uint16_t, unsigned, size_t) {}
+void IoUring::RecycleBuffer(uint16_t) {}
+void IoUring::PrepareRecvMsgMultishot(int, uint16_t, size_t, uint64_t) {}
+
+bool IoUring::ParseRecvMsg(const IoUringCompletion &, IoUringRecvMsg *, uint16_t *)
+{
+    return false;
+}
+
+bool IoUring::HasMore(const IoUringCompletion &)
+{
+    return false;
+}
+
+int IoUring::Submit(unsigned)
+{
+    return -ENOSYS;
+}
+
+bool IoUring::PopCompletion(IoUringCompletion *)
+{
+    return false;
+}
+
+int IoUring::Run(int)
+{
+    return -ENOSYS;
+}
+
+int IoUring::GetRingFd()
+{
+    return -1;
+}
+
+#endif
\ No newline at end of file
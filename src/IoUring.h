@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "NanoException.h"
+
+/// Completion of a request submitted to IoUring
+struct IoUringCompletion
+{
+	uint64_t userData;
+	int res;
+	uint32_t flags;
+};
+
+/// Datagram received by multishot recvmsg, points into a provided buffer
+struct IoUringRecvMsg
+{
+	const struct sockaddr_in *address;
+	const uint8_t *control;
+	size_t controlLen;
+	const uint8_t *payload;
+	size_t payloadLen;
+	bool truncated;
+};
+
+/// Minimal io_uring ring used as an alternative I/O backend for sockets.
+/// Single requests refer to sockets by descriptor, long running multishot ones through the registered file table.
+class IoUring
+{
+public:
+	/// Creates the ring with the provided number of submission entries and
+	/// optionally completion entries (defaults to twice the submission entries)
+	IoUring(unsigned entries, unsigned cqEntries = 0);
+	IoUring(const IoUring &ring) = delete;
+	~IoUring();
+
+	/// Checks whether the library was built with io_uring support and the kernel provides it
+	static bool IsSupported();
+
+	/// Registers descriptors, requests use their index in the table instead of the descriptor
+	void RegisterFiles(const int *fds, unsigned count);
+
+	/// Prepares send request on descriptor fd
+	void PrepareSend(int fd, const void *buf, size_t len, int flags);
+
+	/// Prepares recv request on descriptor fd
+	void PrepareRecv(int fd, void *buf, size_t len, int flags);
+
+	/// Prepares accept request on descriptor fd
+	void PrepareAccept(int fd);
+
+	/// Registers a ring of count (power of two) buffers of bufSize bytes provided to requests of group bgid
+	void SetupBufferRing(uint16_t bgid, unsigned count, size_t bufSize);
+
+	/// Gives the buffer back to the provided buffer ring once its data has been consumed
+	void RecycleBuffer(uint16_t bid);
+
+	/// Prepares multishot recvmsg on registered file, which receives datagrams into buffers of group bgid
+	/// until it is terminated. Space for controlLen bytes of ancillary data is reserved in every buffer
+	void PrepareRecvMsgMultishot(int fileIndex, uint16_t bgid, size_t controlLen, uint64_t userData);
+
+	/// Splits the buffer of recvmsg completion into address, ancillary data and payload.
+	/// Returns false when the completion does not carry a buffer
+	bool ParseRecvMsg(const IoUringCompletion &completion, IoUringRecvMsg *msg, uint16_t *bid);
+
+	/// Checks whether multishot request will post further completions
+	static bool HasMore(const IoUringCompletion &completion);
+
+	/// Submits prepared requests and waits for at least waitNr completions.
+	/// Returns number of submitted requests or negative errno
+	int Submit(unsigned waitNr);
+
+	/// Pops next completion, returns false when the completion queue is empty
+	bool PopCompletion(IoUringCompletion *completion);
+
+	/// Submits the prepared request, linked with a timeout in seconds when timeout > 0,
+	/// and waits for its completion in a single syscall. Returns the result of the request
+	/// (negative errno on failure) or -ETIME when the timeout has expired. No request of the call is left
+	/// in the ring when it returns, if it can't be waited on the ring is closed
+	int Run(int timeout);
+
+	/// Gets the low level ring descriptor, -1 once the ring has been closed
+	int GetRingFd();
+
+private:
+	int ringFd;
+	unsigned sqEntries;
+	void *sqPtr;
+	void *cqPtr;
+	size_t sqRingSize;
+	size_t cqRingSize;
+	void *sqes;
+	size_t sqesSize;
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	void *cqes;
+	unsigned sqeHead;
+	unsigned sqeTail;
+	void *bufRing;
+	size_t bufRingSize;
+	uint8_t *buffers;
+	size_t buffersSize;
+	size_t bufSize;
+	unsigned bufCount;
+	uint16_t bufTail;
+	struct msghdr multishotMsg;
+
+	void *GetSqe();
+	void Abandon(unsigned expected);
+	void Release();
+};
+
+class IoUringException : public NanoException
+{
+public:
+	IoUringException(std::string msg) : NanoException(msg) {}
+};
\ No newline at end of file
@@ -0,0 +1,138 @@
+#include "PatternSearch.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PATTERN_SEARCH_X86
+#include <immintrin.h>
+#endif
+
+typedef ssize_t (*FindFunction)(const uint8_t *, size_t, const uint8_t *, size_t);
+
+static FindFunction SelectKernel()
+{
+    if (PatternSearch::HasAvx2())
+        return PatternSearch::FindAvx2;
+    if (PatternSearch::HasSse2())
+        return PatternSearch::FindSse2;
+    return PatternSearch::FindScalar;
+}
+
+ssize_t PatternSearch::Find(const uint8_t *buf, size_t len, const uint8_t *pattern, size_t patternlen)
+{
+    static const FindFunction kernel = SelectKernel();
+    return kernel(buf, len, pattern, patternlen);
+}
+
+ssize_t PatternSearch::FindScalar(const uint8_t *buf, size_t len, const uint8_t *pattern, size_t patternlen)
+{
+    if (patternlen == 0 || len < patternlen)
+        return -1;
+    for (size_t i = 0; i <= len - patternlen; ++i)
+    {
+        size_t j = 0;
+        while (j < patternlen && buf[i + j] == pattern[j])
+            ++j;
+        if (j == patternlen)
+            return i;
+    }
+    return -1;
+}
+
+#ifdef PATTERN_SEARCH_X86
+
+// Candidates are positions where both the first and the last byte of the pattern match,
+// only those are verified with memcmp. For single byte patterns the first byte compare is enough.
+
+__attribute__((target("sse2"))) ssize_t PatternSearch::FindSse2(const uint8_t *buf, size_t len, const uint8_t *pattern, size_t patternlen)
+{
+    if (!HasSse2())
+        return FindScalar(buf, len, pattern, patternlen);
+    if (patternlen == 0 || len < patternlen)
+        return -1;
+
+    const size_t last = patternlen - 1;
+    const size_t end = len - last;
+    const __m128i first = _mm_set1_epi8((char)pattern[0]);
+    const __m128i lastb = _mm_set1_epi8((char)pattern[last]);
+    size_t i = 0;
+    for (; i + 16 <= end; i += 16)
+    {
+        __m128i a = _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i *)(buf + i)));
+        __m128i b = _mm_cmpeq_epi8(lastb, _mm_loadu_si128((const __m128i *)(buf + i + last)));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(a, b));
+        while (mask)
+        {
+            unsigned bit = __builtin_ctz(mask);
+            if (patternlen <= 2 || memcmp(buf + i + bit + 1, pattern + 1, patternlen - 2) == 0)
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    ssize_t idx = FindScalar(buf + i, len - i, pattern, patternlen);
+    return idx < 0 ? -1 : idx + i;
+}
+
+__attribute__((target("avx2"))) ssize_t PatternSearch::FindAvx2(const uint8_t *buf, size_t len, const uint8_t *pattern, size_t patternlen)
+{
+    if (!HasAvx2())
+        return FindSse2(buf, len, pattern, patternlen);
+    if (patternlen == 0 || len < patternlen)
+        return -1;
+
+    const size_t last = patternlen - 1;
+    const size_t end = len - last;
+    const __m256i first = _mm256_set1_epi8((char)pattern[0]);
+    const __m256i lastb = _mm256_set1_epi8((char)pattern[last]);
+    size_t i = 0;
+    for (; i + 32 <= end; i += 32)
+    {
+        __m256i a = _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i *)(buf + i)));
+        __m256i b = _mm256_cmpeq_epi8(lastb, _mm256_loadu_si256((const __m256i *)(buf + i + last)));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(a, b));
+        while (mask)
+        {
+            unsigned bit = __builtin_ctz(mask);
+            if (patternlen <= 2 || memcmp(buf + i + bit + 1, pattern + 1, patternlen - 2) == 0)
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    ssize_t idx = FindSse2(buf + i, len - i, pattern, patternlen);
+    return idx < 0 ? -1 : idx + i;
+}
+
+bool PatternSearch::HasSse2()
+{
+    static const bool supported = __builtin_cpu_supports("sse2");
+    return supported;
+}
+
+bool PatternSearch::HasAvx2()
+{
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+
+#else
+
+ssize_t PatternSearch::FindSse2(const uint8_t *buf, size_t len, const uint8_t *pattern, size_t patternlen)
+{
+    return FindScalar(buf, len, pattern, patternlen);
+}
+
+ssize_t PatternSearch::FindAvx2(const uint8_t *buf, size_t len, const uint8_t *pattern, size_t patternlen)
+{
+    return FindScalar(buf, len, pattern, patternlen);
+}
+
+bool PatternSearch::HasSse2()
+{
+    return false;
+}
+
+bool PatternSearch::HasAvx2()
+{
+    return false;
+}
+
+#endif
\ No newline at end of file
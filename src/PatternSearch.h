@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+
+/// Delimiter search used by line oriented receive paths
+class PatternSearch
+{
+public:
+	/// Finds the first occurrence of pattern in buf using the fastest kernel supported by the cpu.
+	/// Returns its offset or -1 when not found
+	static ssize_t Find(const uint8_t *buf, size_t len, const uint8_t *pattern, size_t patternlen);
+
+	/// Portable byte by byte kernel
+	static ssize_t FindScalar(const uint8_t *buf, size_t len, const uint8_t *pattern, size_t patternlen);
+
+	/// 16 bytes per step kernel, falls back to FindScalar when SSE2 is unavailable
+	static ssize_t FindSse2(const uint8_t *buf, size_t len, const uint8_t *pattern, size_t patternlen);
+
+	/// 32 bytes per step kernel, falls back to FindSse2 when AVX2 is unavailable
+	static ssize_t FindAvx2(const uint8_t *buf, size_t len, const uint8_t *pattern, size_t patternlen);
+
+	/// Checks whether the cpu supports SSE2
+	static bool HasSse2();
+
+	/// Checks whether the cpu supports AVX2
+	static bool HasAvx2();
+};
\ No newline at end of file
@@ -1,8 +1,19 @@
 #include "Socket.h"
+#include "IoUring.h"
+#include "PatternSearch.h"
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <netinet/udp.h>
 
-std::shared_ptr<Socket> Socket::Create(int type)
+std::atomic<IoBackend> Socket::defaultIoBackend(IoBackend::Default);
+
+std::shared_ptr<Socket> Socket::Create(int type, bool nonblocking)
 {
-    int socket_descriptor = socket(AF_INET, type, 0);
+    int socket_descriptor = socket(AF_INET, type | (nonblocking ? SOCK_NONBLOCK : 0), 0);
     if (socket_descriptor < 0)
     {
         std::string err(strerror(errno));
@@ -11,12 +22,15 @@ std::shared_ptr<Socket> Socket::Create(int type)
     return std::make_shared<Socket>(socket_descriptor);
 }
 
-Socket::Socket(int socket_descriptor)
+Socket::Socket(int socket_descriptor) : messagePending(false), ioBackend(IoBackend::Default), nonblocking(false), gsoUnsupported(false), zeroCopyThreshold(0), zeroCopyNextId(0)
 {
     SetSocket(socket_descriptor);
+    nonblocking = fcntl(socket_descriptor, F_GETFL) & O_NONBLOCK;
     boundAddress = nullptr;
     connectedAddress = nullptr;
     timeout = 0;
+    rbegin = rend = 0;
+    SetIoBackend(defaultIoBackend.load());
 }
 
 Socket::~Socket()
@@ -29,8 +43,28 @@ int Socket::GetSocket()
     return socket_descriptor;
 }
 
+int Socket::Duplicate()
+{
+    int fd = socket_descriptor.load();
+    if (fd < 0)
+        return -1;
+    int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    // Close forgets the descriptor before closing it, so a copy taken before still refers to this socket
+    if (copy >= 0 && socket_descriptor.load() != fd)
+    {
+        close(copy);
+        return -1;
+    }
+    return copy;
+}
+
 void Socket::SetSocket(int socket_descriptor)
 {
+    rbegin = rend = 0;
+    // zero copy ids are counted per descriptor
+    ReleaseZeroCopySends(true);
+    zeroCopyThreshold = 0;
+    zeroCopyNextId = 0;
     this->socket_descriptor = socket_descriptor;
     if (!IsValidDescriptor())
     {
@@ -56,6 +90,45 @@ void Socket::DisableTimeout()
     this->timeout = 0;
 }
 
+void Socket::SetNonBlocking(bool nonblocking)
+{
+    int flags = fcntl(socket_descriptor, F_GETFL);
+    if (flags < 0)
+    {
+        std::string err(strerror(errno));
+        throw SocketException("fcntl error: " + err);
+    }
+    flags = nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    if (fcntl(socket_descriptor, F_SETFL, flags) < 0)
+    {
+        std::string err(strerror(errno));
+        throw SocketException("fcntl error: " + err);
+    }
+    this->nonblocking = nonblocking;
+}
+
+bool Socket::IsNonBlocking()
+{
+    return nonblocking.load();
+}
+
+void Socket::SetDefaultIoBackend(IoBackend backend)
+{
+    defaultIoBackend = backend;
+}
+
+void Socket::SetIoBackend(IoBackend backend)
+{
+    if (backend == IoBackend::IoUring && !IoUring::IsSupported())
+        backend = IoBackend::Default;
+    ioBackend = backend;
+}
+
+IoBackend Socket::GetIoBackend()
+{
+    return ioBackend.load();
+}
+
 int Socket::GetSocketType()
 {
     int type;
@@ -64,6 +137,16 @@ int Socket::GetSocketType()
     return type;
 }
 
+void Socket::EnableReusePort()
+{
+    int yes = 1;
+    if (setsockopt(socket_descriptor, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) < 0)
+    {
+        std::string err(strerror(errno));
+        throw SocketException("setsockopt error: " + err);
+    }
+}
+
 void Socket::Bind(std::shared_ptr<Address> address)
 {
     int yes = 1;
@@ -76,7 +159,7 @@ void Socket::Bind(std::shared_ptr<Address> address)
     {
         throw std::invalid_argument("Param address must not be null");
     }
-    if (bind(socket_descriptor, (struct sockaddr *)address->GetRawAddress(), sizeof(struct sockaddr)) < 0)
+    if (::bind(socket_descriptor, (struct sockaddr *)address->GetRawAddress(), sizeof(struct sockaddr)) < 0)
     {
         std::string err(strerror(errno));
         throw SocketException("bind error: " + err);
@@ -109,13 +192,40 @@ void Socket::Listen(int backlog)
 
 std::shared_ptr<Socket> Socket::Accept()
 {
-    int socket = accept(socket_descriptor, nullptr, nullptr);
-    if (socket < 0)
+    int socket;
+    for (;;)
     {
+        IoUring *ring;
+        if ((ring = GetRing()))
+        {
+            ring->PrepareAccept(socket_descriptor);
+            socket = RingResult(ring->Run(0));
+        }
+        else
+        {
+            socket = accept(socket_descriptor, nullptr, nullptr);
+        }
+        if (socket >= 0)
+            break;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return nullptr;
+        }
+        // the connection failed before it was accepted, the next one may be fine
+        if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO || errno == ENETDOWN || errno == ENETUNREACH ||
+            errno == EHOSTDOWN || errno == EHOSTUNREACH || errno == ENONET || errno == ENOPROTOOPT || errno == EOPNOTSUPP)
+            continue;
+        bool exhausted = errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM;
         std::string err(strerror(errno));
+        if (exhausted)
+        {
+            throw ResourceExhaustedException("accept error: " + err);
+        }
         throw SocketException("accept error: " + err);
     }
-    return std::make_shared<Socket>(socket);
+    auto client = std::make_shared<Socket>(socket);
+    client->SetIoBackend(ioBackend.load());
+    return client;
 }
 
 Address Socket::GetRemoteAddress()
@@ -141,13 +251,14 @@ std::shared_ptr<Address> Socket::GetBoundAddress()
 
 void Socket::Close()
 {
-    if (IsValidDescriptor())
+    // sends still in flight keep the connection open on a copy of the descriptor, the peer still gets the end of the stream
+    if (ReleaseZeroCopySends(true))
+        shutdown(socket_descriptor, SHUT_WR);
+    int fd = socket_descriptor.exchange(-1);
+    if (fd >= 0 && close(fd) < 0 && errno != EBADF)
     {
-        if (close(socket_descriptor) < 0)
-        {
-            std::string err(strerror(errno));
-            throw SocketException("close: " + err);
-        }
+        std::string err(strerror(errno));
+        throw SocketException("close: " + err);
     }
 }
 
@@ -165,7 +276,7 @@ void Socket::Shutdown()
 
 void Socket::SendAll(const std::string &data)
 {
-    SendAll(std::vector<uint8_t>(data.begin(), data.end()));
+    SendAll((const uint8_t *)data.data(), data.size());
 }
 
 void Socket::SendAll(const std::vector<uint8_t> &data)
@@ -179,10 +290,10 @@ void Socket::SendAll(const uint8_t *buf, size_t len)
     size_t bytesleft = len;
     ssize_t n;
 
-    std::lock_guard<std::mutex> lock(_send);
+    std::unique_lock<std::mutex> lock = LockSend();
     while (bytesleft > 0)
     {
-        if ((n = send(socket_descriptor, buf + total, bytesleft, MSG_NOSIGNAL)) <= 0)
+        if ((n = SendWrapper(buf + total, bytesleft, MSG_NOSIGNAL)) <= 0)
         {
             if (n < 0 && errno == EINTR)
                 n = 0;
@@ -206,216 +317,1191 @@ void Socket::SendAll(const uint8_t *buf, size_t len)
     }
 }
 
-std::string Socket::RecvAllString(size_t len)
+void Socket::SendAllV(const struct iovec *iov, size_t iovcnt)
 {
-    auto data = RecvAll(len);
-    return std::string(data.begin(), data.end());
+    size_t idx = 0;
+    size_t offset = 0;
+    struct iovec window[maxIovWindow];
+
+    std::unique_lock<std::mutex> lock = LockSend();
+    AdvanceIov(iov, iovcnt, &idx, &offset, 0);
+    while (idx < iovcnt)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = window;
+        msg.msg_iovlen = FillIovWindow(iov, iovcnt, idx, offset, window);
+
+        ssize_t n = sendmsg(socket_descriptor, &msg, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && nonblocking.load())
+            {
+                WaitForEvents(POLLOUT, 0);
+                continue;
+            }
+            if (errno == EPIPE || errno == ECONNRESET)
+            {
+                throw SocketConnectionClosedException("Connection has been closed");
+            }
+            std::string err(strerror(errno));
+            throw SendException("sendall error: " + err);
+        }
+        AdvanceIov(iov, iovcnt, &idx, &offset, n);
+    }
 }
 
-std::vector<uint8_t> Socket::RecvAll(size_t len)
+void Socket::SendFile(int fd, off_t offset, size_t length)
 {
-    std::vector<uint8_t> data(len);
-    RecvAll(data.data(), data.size());
-    return data;
+    std::unique_lock<std::mutex> lock = LockSend();
+    size_t sent = SendFileSendfile(fd, offset, length);
+    if (sent < length)
+    {
+        SendFileSplice(fd, offset + sent, length - sent);
+    }
 }
 
-void Socket::RecvAll(uint8_t *buf, size_t len)
+size_t Socket::SendFileSendfile(int fd, off_t offset, size_t length)
 {
     size_t total = 0;
-    size_t bytesleft = len;
-    ssize_t n;
-
-    if (len == 0)
-        return;
-
-    std::lock_guard<std::mutex> lock(_recv);
-    while (bytesleft > 0)
+    while (total < length)
     {
-        if ((n = RecvTimeoutWrapper(buf + total, bytesleft, 0)) < 0)
+        ssize_t n = sendfile(socket_descriptor, fd, &offset, length - total);
+        if (n < 0)
         {
             if (errno == EINTR)
-                n = 0;
-            else
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && nonblocking.load())
             {
-                n = -1;
-                break;
+                WaitForEvents(POLLOUT, 0);
+                continue;
             }
+            // fd does not support sendfile, e.g. a pipe
+            if ((errno == EINVAL || errno == ENOSYS || errno == ESPIPE) && total == 0)
+                return 0;
+            ThrowSendError("sendfile");
+        }
+        if (n == 0)
+        {
+            throw SendException("sendfile error: Unexpected end of file");
         }
-        else if (n == 0)
-            break;
         total += n;
-        bytesleft -= n;
     }
-    if (n < 0)
+    return total;
+}
+
+void Socket::SendFileSplice(int fd, off_t offset, size_t length)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
     {
         std::string err(strerror(errno));
-        throw RecvException("recvall error: " + err);
+        throw SendException("fstat error: " + err);
     }
-    if (n == 0)
+    // pipes are spliced directly to the socket and have no offset
+    bool isPipe = S_ISFIFO(st.st_mode);
+    loff_t off = offset;
+
+    int pipefd[2] = {-1, -1};
+    if (!isPipe && pipe2(pipefd, O_CLOEXEC) < 0)
     {
-        throw SocketConnectionClosedException("Connection has been closed");
+        std::string err(strerror(errno));
+        throw SendException("pipe error: " + err);
     }
-}
+    int in = isPipe ? fd : pipefd[0];
 
-std::string Socket::RecvUntilString(const std::string pattern, size_t maxlen)
-{
-    auto data = RecvUntil(pattern, maxlen);
-    return std::string(data.begin(), data.end());
+    size_t total = 0;
+    size_t inPipe = 0;
+    try
+    {
+        while (total < length)
+        {
+            if (!isPipe && inPipe == 0)
+            {
+                ssize_t n = splice(fd, &off, pipefd[1], nullptr, length - total, SPLICE_F_MOVE);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                    ThrowSendError("splice");
+                if (n == 0)
+                    throw SendException("splice error: Unexpected end of file");
+                inPipe = n;
+            }
+            size_t chunk = isPipe ? length - total : inPipe;
+            ssize_t n = splice(in, nullptr, socket_descriptor, nullptr, chunk, SPLICE_F_MOVE | (total + chunk < length ? SPLICE_F_MORE : 0));
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if ((errno == EAGAIN || errno == EWOULDBLOCK) && nonblocking.load())
+                {
+                    WaitForEvents(POLLOUT, 0);
+                    continue;
+                }
+                ThrowSendError("splice");
+            }
+            if (n == 0)
+                throw SendException("splice error: Unexpected end of file");
+            total += n;
+            inPipe -= isPipe ? 0 : n;
+        }
+    }
+    catch (...)
+    {
+        if (!isPipe)
+        {
+            close(pipefd[0]);
+            close(pipefd[1]);
+        }
+        throw;
+    }
+    if (!isPipe)
+    {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
 }
 
-std::vector<uint8_t> Socket::RecvUntil(const std::string pattern, size_t maxlen)
+bool Socket::EnableZeroCopy(size_t threshold)
 {
-    return RecvUntil(std::vector<uint8_t>(pattern.begin(), pattern.end()), maxlen);
+    int yes = 1;
+    if (setsockopt(socket_descriptor, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(int)) < 0)
+    {
+        if (errno == ENOPROTOOPT || errno == EOPNOTSUPP || errno == EINVAL)
+            return false;
+        std::string err(strerror(errno));
+        throw SocketException("setsockopt error: " + err);
+    }
+    zeroCopyThreshold = std::max<size_t>(threshold, 1);
+    return true;
 }
 
-std::vector<uint8_t> Socket::RecvUntil(const std::vector<uint8_t> &pattern, size_t maxlen)
+void Socket::SendAllZeroCopy(std::shared_ptr<const std::vector<uint8_t>> data)
 {
-    size_t len = 0;
-    std::vector<uint8_t> data(maxlen);
-    RecvUntil(data.data(), data.size(), pattern.data(), pattern.size(), &len);
-    data.resize(len);
-    return data;
+    const uint8_t *buf = data->data();
+    size_t len = data->size();
+    SendAllZeroCopy(buf, len, [data] {});
 }
 
-void Socket::RecvUntil(uint8_t *buf, size_t buflen, const uint8_t *pattern, size_t patternlen, size_t *len)
+void Socket::SendAllZeroCopy(const uint8_t *buf, size_t len, std::function<void()> onComplete)
 {
-    size_t total = 0;
-    ssize_t bytesleft = buflen;
-    ssize_t n;
-
-    std::lock_guard<std::mutex> lock(_recvuntil);
-    int patternidx;
-    do
+    size_t threshold = zeroCopyThreshold.load();
+    if (threshold == 0 || len < threshold)
     {
-        if (bytesleft <= 0)
+        // page pinning and the completion notification cost more than copying small payloads
+        try
         {
-            throw std::overflow_error("recvuntil error: Overflow error");
+            SendAll(buf, len);
         }
-        if ((n = RecvTimeoutWrapper(buf + total, bytesleft, MSG_PEEK)) < 0)
+        catch (...)
         {
-            if (errno == EINTR)
-                n = 0;
-            else
-            {
-                n = -1;
-                break;
-            }
+            if (onComplete)
+                onComplete();
+            throw;
         }
-        else if (n == 0)
-            break;
-        if (n > 0)
+        if (onComplete)
+            onComplete();
+        return;
+    }
+
+    // callbacks run after the send lock is released, they may send on this socket again
+    std::vector<std::function<void()>> done;
+    std::exception_ptr error;
+    std::unique_lock<std::mutex> lock;
+    try
+    {
+        lock = LockSend();
+    }
+    catch (...)
+    {
+        // nothing has been handed to the kernel
+        if (onComplete)
+            onComplete();
+        throw;
+    }
+    try
+    {
+        SendZeroCopy(buf, len, std::move(onComplete), done);
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    lock.unlock();
+    for (auto &complete : done)
+    {
+        if (complete)
+            complete();
+    }
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void Socket::SendZeroCopy(const uint8_t *buf, size_t len, std::function<void()> onComplete, std::vector<std::function<void()>> &done)
+{
+    ReadZeroCopyCompletions(done);
+    {
+        std::lock_guard<std::mutex> zlock(_zerocopy);
+        zeroCopyPending.push_back(ZeroCopySend{zeroCopyNextId, 0, 0, false, std::move(onComplete)});
+    }
+    size_t total = 0;
+    try
+    {
+        while (total < len)
         {
-            patternidx = IsContainPattern(buf, total + n, pattern, patternlen);
-            if (patternidx < 0)
+            ssize_t n = send(socket_descriptor, buf + total, len - total, MSG_NOSIGNAL | MSG_ZEROCOPY);
+            if (n < 0)
             {
-                RecvAll(buf + total, n);
+                if (errno == EINTR)
+                    continue;
+                if ((errno == EAGAIN || errno == EWOULDBLOCK) && nonblocking.load())
+                {
+                    WaitForEvents(POLLOUT, 0);
+                    continue;
+                }
+                if (errno == ENOBUFS)
+                {
+                    // notifications are charged to the socket option memory until they are read
+                    std::unique_lock<std::mutex> zlock(_zerocopy);
+                    bool inFlight = zeroCopyPending.size() > 1 || zeroCopyPending.back().completed < zeroCopyPending.back().count;
+                    zlock.unlock();
+                    if (inFlight)
+                    {
+                        WaitForErrorQueue();
+                        ReadZeroCopyCompletions(done);
+                        continue;
+                    }
+                }
+                ThrowSendError("send");
             }
-            else
+            // every successful MSG_ZEROCOPY send gets the next id
             {
-                n = patternidx - (total - 1);
-                RecvAll(buf + total, n);
+                std::lock_guard<std::mutex> zlock(_zerocopy);
+                ++zeroCopyNextId;
+                ++zeroCopyPending.back().count;
             }
+            total += n;
         }
-        total += n;
-        bytesleft -= n;
-    } while (patternidx < 0);
-    if (n < 0)
-    {
-        std::string err(strerror(errno));
-        throw RecvException("recvall error: " + err);
     }
-    if (n == 0)
+    catch (...)
     {
-        throw SocketConnectionClosedException("Connection has been closed");
+        SealZeroCopySend(done);
+        throw;
     }
-    *len = total;
+    SealZeroCopySend(done);
 }
 
-void Socket::SendTo(const std::shared_ptr<Address> address, const std::string &data)
+size_t Socket::ReapZeroCopyCompletions(bool wait)
 {
-    SendTo(address, std::vector<uint8_t>(data.begin(), data.end()));
+    bool more = true;
+    for (;;)
+    {
+        std::vector<std::function<void()>> done;
+        size_t pending = ReadZeroCopyCompletions(done);
+        for (auto &onComplete : done)
+        {
+            if (onComplete)
+                onComplete();
+        }
+        if (!wait || pending == 0 || !more)
+            return pending;
+        more = WaitForErrorQueue();
+    }
 }
 
-void Socket::SendTo(const std::shared_ptr<Address> address, const std::vector<uint8_t> &data)
+size_t Socket::ReadZeroCopyCompletions(std::vector<std::function<void()>> &done)
 {
-    SendTo(address, data.data(), data.size());
+    std::lock_guard<std::mutex> lock(_zerocopy);
+    while (!zeroCopyPending.empty())
+    {
+        alignas(struct cmsghdr) char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(socket_descriptor, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            std::string err(strerror(errno));
+            throw SendException("recvmsg error: " + err);
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+            struct sock_extended_err serr;
+            memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+            // ee_info..ee_data is an inclusive range of completed send ids
+            if (serr.ee_origin == SO_EE_ORIGIN_ZEROCOPY && serr.ee_errno == 0)
+                CompleteZeroCopy(serr.ee_info, serr.ee_data, done);
+        }
+    }
+    return zeroCopyPending.size();
 }
 
-void Socket::SendTo(const std::shared_ptr<Address> address, const uint8_t *buf, size_t len)
+void Socket::CompleteZeroCopy(uint32_t lo, uint32_t hi, std::vector<std::function<void()>> &done)
 {
-    struct sockaddr *addr = (struct sockaddr *)address->GetRawAddress();
-    if (sendto(socket_descriptor, buf, len, 0, addr, sizeof(*addr)) < 0)
+    for (auto it = zeroCopyPending.begin(); it != zeroCopyPending.end();)
     {
-        std::string err(strerror(errno));
-        throw SendException("sendto error: " + err);
+        // ids are compared relative to the first id of the send so that wrapping around is harmless
+        uint32_t limit = it->sealed ? it->count : 1u << 31;
+        uint32_t from = lo - it->first;
+        uint32_t to = hi - it->first;
+        if (from > to)
+            from = 0;
+        if (from < limit)
+            it->completed += std::min(to, limit - 1) - from + 1;
+        if (it->sealed && it->completed >= it->count)
+        {
+            done.push_back(std::move(it->onComplete));
+            it = zeroCopyPending.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
     }
 }
 
-std::vector<uint8_t> Socket::RecvFrom(std::shared_ptr<Address> &address, size_t len)
+void Socket::SealZeroCopySend(std::vector<std::function<void()>> &done)
 {
-    std::vector<uint8_t> data(len);
-    size_t size = RecvFrom(address, data.data(), data.size());
-    data.resize(size);
-    return data;
+    std::lock_guard<std::mutex> lock(_zerocopy);
+    ZeroCopySend &send = zeroCopyPending.back();
+    send.sealed = true;
+    if (send.completed < send.count)
+        return;
+    done.push_back(std::move(send.onComplete));
+    zeroCopyPending.pop_back();
 }
 
-size_t Socket::RecvFrom(std::shared_ptr<Address> &address, uint8_t *buf, size_t len)
+bool Socket::WaitForErrorQueue()
 {
+    struct pollfd pfd;
+    pfd.fd = socket_descriptor;
+    // POLLERR is always reported, it is set while the error queue is not empty
+    pfd.events = 0;
     int n;
-    struct sockaddr_in addr;
-    socklen_t addrlen = sizeof(addr);
-    if ((n = recvfrom(socket_descriptor, buf, len, 0, (struct sockaddr *)&addr, &addrlen)) < 0)
+    do
     {
-        std::string err(strerror(errno));
-        throw RecvException("recvfrom error: " + err);
-    }
-    address = std::make_shared<Address>(addr);
-    return n;
+        n = poll(&pfd, 1, timeout > 0 ? timeout * 1000 : -1);
+    } while (n == -1 && errno == EINTR);
+    if (n == 0)
+        throw TimeoutException("Waiting time has been exceeded");
+    if (n == -1)
+        throw SendException("poll error: " + std::string(strerror(errno)));
+    return !(pfd.revents & (POLLHUP | POLLNVAL));
 }
 
-void Socket::ApplyRecvTimeout()
+bool Socket::ReleaseZeroCopySends(bool defer)
 {
-    if (timeout > 0)
+    std::vector<std::function<void()>> done;
+    std::unique_lock<std::mutex> lock(_zerocopy);
+    if (zeroCopyPending.empty())
+        return false;
+    lock.unlock();
+    try
     {
-        struct pollfd pfd;
-        pfd.fd = socket_descriptor;
-        pfd.events = POLLIN;
-        int n = poll(&pfd, 1, timeout * 1000);
-        if (n == 0)
-            throw TimeoutException("Waiting time has been exceeded");
-        else if (n == -1)
-            throw RecvException("select error: " + std::string(strerror(errno)));
+        ReadZeroCopyCompletions(done);
+    }
+    catch (SocketException &)
+    {
+    }
+    std::shared_ptr<Socket> closed;
+    lock.lock();
+    int fd = zeroCopyPending.empty() || !defer ? -1 : fcntl(socket_descriptor, F_DUPFD_CLOEXEC, 0);
+    if (fd >= 0)
+    {
+        // the kernel may still transmit from the buffers and completions can't be read once the descriptor
+        // is closed, so a copy of the descriptor takes the sends over until the kernel reports them
+        closed = std::make_shared<Socket>(fd);
+        closed->zeroCopyPending.swap(zeroCopyPending);
+    }
+    else
+    {
+        for (auto &send : zeroCopyPending)
+            done.push_back(std::move(send.onComplete));
+        zeroCopyPending.clear();
+    }
+    lock.unlock();
+    for (auto &onComplete : done)
+    {
+        if (onComplete)
+            onComplete();
     }
+    if (!closed)
+        return false;
+    DeferZeroCopyReap(closed);
+    return true;
 }
 
-int Socket::RecvTimeoutWrapper(void *buf, size_t len, int flags)
+namespace
+{
+/// Sockets reaped by the background thread, allocated once and never freed so that the detached
+/// thread can't outlive it at exit
+struct ZeroCopyReaper
+{
+    std::mutex mtx;
+    std::vector<std::shared_ptr<Socket>> sockets;
+    bool running = false;
+};
+
+ZeroCopyReaper &GetZeroCopyReaper()
+{
+    static ZeroCopyReaper *reaper = new ZeroCopyReaper();
+    return *reaper;
+}
+}
+
+void Socket::DeferZeroCopyReap(std::shared_ptr<Socket> socket)
 {
-    ApplyRecvTimeout();
-    return recv(socket_descriptor, buf, len, flags);
+    ZeroCopyReaper &reaper = GetZeroCopyReaper();
+    std::lock_guard<std::mutex> lock(reaper.mtx);
+    reaper.sockets.push_back(socket);
+    if (reaper.running)
+        return;
+    std::thread(RunZeroCopyReaper).detach();
+    reaper.running = true;
 }
 
-int Socket::IsContainPattern(const uint8_t *buf, size_t len, const uint8_t *pattern, size_t patternlen)
+void Socket::RunZeroCopyReaper()
 {
-    int notfound = -1;
-    if (len < patternlen)
-        return notfound;
-    else if ((len == 0) && (patternlen == 0))
-        return notfound;
-    else if (patternlen == 0)
-        return notfound;
-    for (size_t i = 0, j = 0; i < len; ++i)
+    ZeroCopyReaper &reaper = GetZeroCopyReaper();
+    for (;;)
     {
-        if (buf[i] == pattern[j])
+        std::vector<std::shared_ptr<Socket>> sockets;
         {
-            if (j == patternlen - 1)
-                return i;
-            else
-                ++j;
+            std::lock_guard<std::mutex> lock(reaper.mtx);
+            if (reaper.sockets.empty())
+            {
+                reaper.running = false;
+                return;
+            }
+            sockets = reaper.sockets;
         }
-        else
-            j = 0;
+        // POLLERR is set while the error queue is not empty, the timeout picks up sockets added meanwhile
+        std::vector<struct pollfd> pfds(sockets.size());
+        for (size_t i = 0; i < sockets.size(); ++i)
+        {
+            pfds[i].fd = sockets[i]->socket_descriptor;
+            pfds[i].events = 0;
+        }
+        int n = poll(pfds.data(), pfds.size(), 100);
+        bool progress = false;
+        std::vector<std::shared_ptr<Socket>> finished;
+        for (size_t i = 0; i < sockets.size(); ++i)
+        {
+            if (!(pfds[i].revents & (POLLERR | POLLHUP | POLLNVAL)))
+                continue;
+            std::vector<std::function<void()>> done;
+            try
+            {
+                sockets[i]->ReadZeroCopyCompletions(done);
+            }
+            catch (SocketException &)
+            {
+                // completions can't be read anymore, nothing is left to wait for
+                sockets[i]->ReleaseZeroCopySends(false);
+            }
+            for (auto &onComplete : done)
+            {
+                if (onComplete)
+                    onComplete();
+            }
+            progress = progress || !done.empty();
+            std::lock_guard<std::mutex> zlock(sockets[i]->_zerocopy);
+            if (sockets[i]->zeroCopyPending.empty())
+                finished.push_back(sockets[i]);
+        }
+        {
+            std::lock_guard<std::mutex> lock(reaper.mtx);
+            for (auto &socket : finished)
+                reaper.sockets.erase(std::find(reaper.sockets.begin(), reaper.sockets.end(), socket));
+        }
+        // a hung up socket is reported until its last sends complete
+        if (n > 0 && !progress && finished.empty())
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+void Socket::ThrowSendError(const std::string &call)
+{
+    if (errno == EPIPE || errno == ECONNRESET)
+    {
+        throw SocketConnectionClosedException("Connection has been closed");
+    }
+    std::string err(strerror(errno));
+    throw SendException(call + " error: " + err);
+}
+
+std::string Socket::RecvAllString(size_t len)
+{
+    auto data = RecvAll(len);
+    return std::string(data.begin(), data.end());
+}
+
+std::vector<uint8_t> Socket::RecvAll(size_t len)
+{
+    std::vector<uint8_t> data(len);
+    RecvAll(data.data(), data.size());
+    return data;
+}
+
+void Socket::RecvAll(uint8_t *buf, size_t len)
+{
+    if (len == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(_recv);
+    size_t total = ConsumeRecvBuffer(buf, len);
+    while (total < len)
+    {
+        size_t bytesleft = len - total;
+        if (bytesleft < recvBufferSize)
+        {
+            // small reads go through the buffer so that following calls are served without syscalls
+            FillRecvBuffer(0);
+            total += ConsumeRecvBuffer(buf + total, bytesleft);
+            continue;
+        }
+        ssize_t n = RecvTimeoutWrapper(buf + total, bytesleft, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            std::string err(strerror(errno));
+            throw RecvException("recvall error: " + err);
+        }
+        if (n == 0)
+        {
+            throw SocketConnectionClosedException("Connection has been closed");
+        }
+        total += n;
+    }
+}
+
+void Socket::RecvAllV(const struct iovec *iov, size_t iovcnt)
+{
+    size_t idx = 0;
+    size_t offset = 0;
+    struct iovec window[maxIovWindow];
+
+    std::lock_guard<std::mutex> lock(_recv);
+    AdvanceIov(iov, iovcnt, &idx, &offset, 0);
+    // buffered bytes come first
+    while (idx < iovcnt && rend > rbegin)
+    {
+        size_t n = ConsumeRecvBuffer((uint8_t *)iov[idx].iov_base + offset, iov[idx].iov_len - offset);
+        AdvanceIov(iov, iovcnt, &idx, &offset, n);
+    }
+    while (idx < iovcnt)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = window;
+        msg.msg_iovlen = FillIovWindow(iov, iovcnt, idx, offset, window);
+
+        ApplyRecvTimeout();
+        ssize_t n = recvmsg(socket_descriptor, &msg, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && nonblocking.load())
+            {
+                WaitForEvents(POLLIN, timeout);
+                continue;
+            }
+            std::string err(strerror(errno));
+            throw RecvException("recvall error: " + err);
+        }
+        if (n == 0)
+        {
+            throw SocketConnectionClosedException("Connection has been closed");
+        }
+        AdvanceIov(iov, iovcnt, &idx, &offset, n);
+    }
+}
+
+std::string Socket::RecvUntilString(const std::string pattern, size_t maxlen)
+{
+    auto data = RecvUntil(pattern, maxlen);
+    return std::string(data.begin(), data.end());
+}
+
+std::vector<uint8_t> Socket::RecvUntil(const std::string pattern, size_t maxlen)
+{
+    return RecvUntil(std::vector<uint8_t>(pattern.begin(), pattern.end()), maxlen);
+}
+
+std::vector<uint8_t> Socket::RecvUntil(const std::vector<uint8_t> &pattern, size_t maxlen)
+{
+    size_t len = 0;
+    std::vector<uint8_t> data(maxlen);
+    RecvUntil(data.data(), data.size(), pattern.data(), pattern.size(), &len);
+    data.resize(len);
+    return data;
+}
+
+void Socket::RecvUntil(uint8_t *buf, size_t buflen, const uint8_t *pattern, size_t patternlen, size_t *len)
+{
+    std::lock_guard<std::mutex> lock(_recv);
+    // bytes at the beginning of the buffer which are known not to contain the pattern
+    size_t scanned = 0;
+    for (;;)
+    {
+        size_t buffered = std::min(rend - rbegin, buflen);
+        ssize_t idx = PatternSearch::Find(rbuf.data() + rbegin + scanned, buffered - scanned, pattern, patternlen);
+        if (idx >= 0)
+        {
+            *len = ConsumeRecvBuffer(buf, scanned + idx + patternlen);
+            return;
+        }
+        if (buffered >= buflen)
+        {
+            throw std::overflow_error("recvuntil error: Overflow error");
+        }
+        // the pattern may start in the last patternlen - 1 bytes and end in the data which is yet to come
+        scanned = buffered >= patternlen ? buffered - patternlen + 1 : 0;
+        FillRecvBuffer(buflen);
+    }
+}
+
+size_t Socket::TrySend(const std::string &data)
+{
+    return TrySend((const uint8_t *)data.data(), data.size());
+}
+
+size_t Socket::TrySend(const uint8_t *buf, size_t len)
+{
+    ssize_t n;
+    do
+    {
+        n = send(socket_descriptor, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno == EPIPE || errno == ECONNRESET)
+        {
+            throw SocketConnectionClosedException("Connection has been closed");
+        }
+        std::string err(strerror(errno));
+        throw SendException("send error: " + err);
+    }
+    return n;
+}
+
+size_t Socket::TrySendMessage(const uint8_t *buf, size_t len)
+{
+    // a blocking send holds the lock until all its data is queued, the message goes after it
+    std::unique_lock<std::mutex> lock(_send, std::try_to_lock);
+    if (!lock.owns_lock())
+        return 0;
+    size_t n = TrySend(buf, len);
+    if (n < len)
+    {
+        if (n > 0)
+            messagePending = true;
+        return n;
+    }
+    if (messagePending.exchange(false))
+        sendDone.notify_all();
+    return n;
+}
+
+void Socket::ReleaseMessage()
+{
+    if (!messagePending.exchange(false))
+        return;
+    // a waiting sender holds the lock from checking the reservation until it waits, so it can't miss this
+    std::lock_guard<std::mutex> lock(_send);
+    sendDone.notify_all();
+}
+
+std::unique_lock<std::mutex> Socket::LockSend()
+{
+    std::unique_lock<std::mutex> lock(_send);
+    // the rest of a message started by TrySendMessage goes first
+    auto finished = [this] { return !messagePending.load(); };
+    if (timeout > 0)
+    {
+        if (!sendDone.wait_for(lock, std::chrono::seconds(timeout), finished))
+            throw TimeoutException("Waiting time has been exceeded");
+    }
+    else
+    {
+        sendDone.wait(lock, finished);
+    }
+    return lock;
+}
+
+size_t Socket::TryRecv(uint8_t *buf, size_t len)
+{
+    ssize_t n;
+    if (len == 0)
+        return 0;
+    {
+        std::lock_guard<std::mutex> lock(_recv);
+        if (rend > rbegin)
+            return ConsumeRecvBuffer(buf, len);
+    }
+    do
+    {
+        n = recv(socket_descriptor, buf, len, MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno == ECONNRESET)
+        {
+            throw SocketConnectionClosedException("Connection has been closed");
+        }
+        std::string err(strerror(errno));
+        throw RecvException("recv error: " + err);
+    }
+    if (n == 0)
+    {
+        throw SocketConnectionClosedException("Connection has been closed");
+    }
+    return n;
+}
+
+void Socket::SendTo(const std::shared_ptr<Address> address, const std::string &data)
+{
+    SendTo(address, (const uint8_t *)data.data(), data.size());
+}
+
+void Socket::SendTo(const std::shared_ptr<Address> address, const std::vector<uint8_t> &data)
+{
+    SendTo(address, data.data(), data.size());
+}
+
+void Socket::SendTo(const std::shared_ptr<Address> address, const uint8_t *buf, size_t len)
+{
+    struct sockaddr *addr = (struct sockaddr *)address->GetRawAddress();
+    if (sendto(socket_descriptor, buf, len, 0, addr, sizeof(*addr)) < 0)
+    {
+        std::string err(strerror(errno));
+        throw SendException("sendto error: " + err);
+    }
+}
+
+std::vector<uint8_t> Socket::RecvFrom(std::shared_ptr<Address> &address, size_t len)
+{
+    std::vector<uint8_t> data(len);
+    size_t size = RecvFrom(address, data.data(), data.size());
+    data.resize(size);
+    return data;
+}
+
+size_t Socket::RecvFrom(std::shared_ptr<Address> &address, uint8_t *buf, size_t len)
+{
+    int n;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    if ((n = recvfrom(socket_descriptor, buf, len, 0, (struct sockaddr *)&addr, &addrlen)) < 0)
+    {
+        std::string err(strerror(errno));
+        throw RecvException("recvfrom error: " + err);
+    }
+    address = std::make_shared<Address>(addr);
+    return n;
+}
+
+void Socket::SendToSegmented(const std::shared_ptr<Address> address, const uint8_t *buf, size_t len, uint16_t segmentSize)
+{
+    if (segmentSize == 0)
+    {
+        throw std::invalid_argument("Param segmentSize must not be zero");
+    }
+    size_t maxSegments = maxCoalescedSize / segmentSize;
+    if (maxSegments > maxGsoSegments)
+        maxSegments = maxGsoSegments;
+    size_t chunkSize = std::max<size_t>(maxSegments, 1) * segmentSize;
+    size_t total = 0;
+    while (total < len && !gsoUnsupported.load())
+    {
+        size_t chunk = std::min(chunkSize, len - total);
+        struct iovec iov;
+        iov.iov_base = (void *)(buf + total);
+        iov.iov_len = chunk;
+        alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(uint16_t))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = (void *)address->GetRawAddress();
+        msg.msg_namelen = sizeof(struct sockaddr_in);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cmsg), &segmentSize, sizeof(uint16_t));
+
+        if (sendmsg(socket_descriptor, &msg, 0) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && nonblocking.load())
+            {
+                WaitForEvents(POLLOUT, 0);
+                continue;
+            }
+            // no UDP_SEGMENT support in the kernel, or no checksum offload on the route (EIO)
+            if (errno == EINVAL || errno == ENOPROTOOPT || errno == EIO)
+            {
+                gsoUnsupported = true;
+                break;
+            }
+            std::string err(strerror(errno));
+            throw SendException("sendmsg error: " + err);
+        }
+        total += chunk;
+    }
+    for (; total < len; total += segmentSize)
+    {
+        SendTo(address, buf + total, std::min<size_t>(segmentSize, len - total));
+    }
+}
+
+bool Socket::EnableGro()
+{
+    int yes = 1;
+    if (setsockopt(socket_descriptor, SOL_UDP, UDP_GRO, &yes, sizeof(int)) < 0)
+    {
+        if (errno == ENOPROTOOPT || errno == EINVAL)
+            return false;
+        std::string err(strerror(errno));
+        throw SocketException("setsockopt error: " + err);
+    }
+    return true;
+}
+
+size_t Socket::RecvFromCoalesced(std::shared_ptr<Address> &address, uint8_t *buf, size_t len, size_t *segmentSize)
+{
+    struct sockaddr_in addr;
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    ssize_t n;
+    for (;;)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &addr;
+        msg.msg_namelen = sizeof(addr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ApplyRecvTimeout();
+        n = recvmsg(socket_descriptor, &msg, 0);
+        if (n >= 0)
+            break;
+        if (errno == EINTR)
+            continue;
+        if ((errno == EAGAIN || errno == EWOULDBLOCK) && nonblocking.load())
+        {
+            WaitForEvents(POLLIN, timeout);
+            continue;
+        }
+        std::string err(strerror(errno));
+        throw RecvException("recvmsg error: " + err);
+    }
+
+    // without the cmsg the buffer holds a single datagram
+    *segmentSize = n;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+        {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(int));
+            if (size > 0)
+                *segmentSize = size;
+        }
+    }
+    address = std::make_shared<Address>(addr);
+    return n;
+}
+
+void Socket::SendToBatch(const std::vector<Datagram> &datagrams)
+{
+    std::vector<struct mmsghdr> msgs(datagrams.size());
+    std::vector<struct iovec> iov(datagrams.size());
+    for (size_t i = 0; i < datagrams.size(); ++i)
+    {
+        iov[i].iov_base = (void *)datagrams[i].data.data();
+        iov[i].iov_len = datagrams[i].data.size();
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = (void *)datagrams[i].address->GetRawAddress();
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    size_t total = 0;
+    while (total < msgs.size())
+    {
+        int n = sendmmsg(socket_descriptor, msgs.data() + total, msgs.size() - total, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && nonblocking.load())
+            {
+                WaitForEvents(POLLOUT, 0);
+                continue;
+            }
+            std::string err(strerror(errno));
+            throw SendException("sendmmsg error: " + err);
+        }
+        total += n;
+    }
+}
+
+size_t Socket::RecvFromBatch(std::vector<Datagram> &datagrams, size_t len)
+{
+    std::vector<struct mmsghdr> msgs(datagrams.size());
+    std::vector<struct iovec> iov(datagrams.size());
+    std::vector<struct sockaddr_in> addrs(datagrams.size());
+    for (size_t i = 0; i < datagrams.size(); ++i)
+    {
+        datagrams[i].data.resize(len);
+        iov[i].iov_base = datagrams[i].data.data();
+        iov[i].iov_len = len;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    size_t n = RecvFromBatch(msgs.data(), msgs.size());
+    for (size_t i = 0; i < n; ++i)
+    {
+        datagrams[i].data.resize(msgs[i].msg_len);
+        datagrams[i].address = std::make_shared<Address>(addrs[i]);
+    }
+    return n;
+}
+
+size_t Socket::RecvFromBatch(struct mmsghdr *msgs, size_t count)
+{
+    int n;
+    for (;;)
+    {
+        ApplyRecvTimeout();
+        // MSG_WAITFORONE blocks for the first datagram only and takes the rest if they are already queued
+        n = recvmmsg(socket_descriptor, msgs, count, MSG_WAITFORONE, nullptr);
+        if (n >= 0)
+            break;
+        if (errno == EINTR)
+            continue;
+        if ((errno == EAGAIN || errno == EWOULDBLOCK) && nonblocking.load())
+        {
+            WaitForEvents(POLLIN, timeout);
+            continue;
+        }
+        std::string err(strerror(errno));
+        throw RecvException("recvmmsg error: " + err);
+    }
+    return n;
+}
+
+void Socket::ApplyRecvTimeout()
+{
+    if (timeout > 0)
+    {
+        WaitForEvents(POLLIN, timeout);
+    }
+}
+
+void Socket::WaitForEvents(short events, int timeout)
+{
+    struct pollfd pfd;
+    pfd.fd = socket_descriptor;
+    pfd.events = events;
+    int n;
+    do
+    {
+        n = poll(&pfd, 1, timeout > 0 ? timeout * 1000 : -1);
+    } while (n == -1 && errno == EINTR);
+    if (n == 0)
+        throw TimeoutException("Waiting time has been exceeded");
+    else if (n == -1 && (events & POLLOUT))
+        throw SendException("poll error: " + std::string(strerror(errno)));
+    else if (n == -1)
+        throw RecvException("select error: " + std::string(strerror(errno)));
+}
+
+int Socket::RecvTimeoutWrapper(void *buf, size_t len, int flags)
+{
+    int n;
+    for (;;)
+    {
+        IoUring *ring = GetRing();
+        if (ring)
+        {
+            // recv and its timeout are submitted together instead of poll followed by recv
+            ring->PrepareRecv(socket_descriptor, buf, len, flags);
+            n = RingResult(ring->Run(timeout));
+        }
+        else
+        {
+            ApplyRecvTimeout();
+            n = recv(socket_descriptor, buf, len, flags);
+        }
+        if (n >= 0 || !nonblocking.load() || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return n;
+        // non-blocking socket, wait until data arrives
+        WaitForEvents(POLLIN, timeout);
+    }
+}
+
+int Socket::SendWrapper(const void *buf, size_t len, int flags)
+{
+    int n;
+    for (;;)
+    {
+        IoUring *ring = GetRing();
+        if (ring)
+        {
+            ring->PrepareSend(socket_descriptor, buf, len, flags);
+            n = RingResult(ring->Run(0));
+        }
+        else
+        {
+            n = send(socket_descriptor, buf, len, flags);
+        }
+        if (n >= 0 || !nonblocking.load() || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return n;
+        // non-blocking socket, wait until there is space in the send buffer
+        WaitForEvents(POLLOUT, 0);
+    }
+}
+
+IoUring *Socket::GetRing()
+{
+    if (ioBackend.load() != IoBackend::IoUring)
+        return nullptr;
+    // every call waits for its own request, so one ring per thread serves all sockets the thread works with.
+    // It is not owned by a socket, closing the socket can't free it under a call of another thread
+    thread_local std::unique_ptr<IoUring> ring;
+    // a ring which could not be waited on is closed by IoUring::Run
+    if (!ring || ring->GetRingFd() < 0)
+    {
+        try
+        {
+            ring.reset(new IoUring(ringEntries));
+        }
+        catch (IoUringException &e)
+        {
+            // e.g. io_uring is not permitted or memlock limit is exceeded
+            ring.reset();
+            ioBackend = IoBackend::Default;
+            return nullptr;
+        }
+    }
+    return ring.get();
+}
+
+int Socket::RingResult(int res)
+{
+    if (res == -ETIME)
+        throw TimeoutException("Waiting time has been exceeded");
+    if (res < 0)
+    {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+size_t Socket::FillRecvBuffer(size_t minspace)
+{
+    size_t capacity = std::max(recvBufferSize, minspace);
+    if (rbegin == rend)
+    {
+        rbegin = rend = 0;
+    }
+    else if (rbuf.size() - rbegin < capacity)
+    {
+        // move unconsumed bytes to the front to make room for new data
+        std::memmove(rbuf.data(), rbuf.data() + rbegin, rend - rbegin);
+        rend -= rbegin;
+        rbegin = 0;
+    }
+    if (rbuf.size() < capacity)
+        rbuf.resize(capacity);
+
+    ssize_t n;
+    do
+    {
+        n = RecvTimeoutWrapper(rbuf.data() + rend, rbuf.size() - rend, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+    {
+        std::string err(strerror(errno));
+        throw RecvException("recvall error: " + err);
+    }
+    if (n == 0)
+    {
+        throw SocketConnectionClosedException("Connection has been closed");
+    }
+    rend += n;
+    return n;
+}
+
+size_t Socket::ConsumeRecvBuffer(uint8_t *buf, size_t len)
+{
+    size_t n = std::min(len, rend - rbegin);
+    if (n > 0)
+    {
+        std::memcpy(buf, rbuf.data() + rbegin, n);
+        rbegin += n;
+    }
+    if (rbegin == rend && rbuf.size() > recvBufferSize)
+    {
+        // RecvUntil grows the buffer up to its maxlen, don't hold on to that for the rest of the connection
+        std::vector<uint8_t>().swap(rbuf);
+        rbegin = rend = 0;
+    }
+    return n;
+}
+
+size_t Socket::FillIovWindow(const struct iovec *iov, size_t iovcnt, size_t idx, size_t offset, struct iovec *window)
+{
+    size_t count = 0;
+    for (; idx < iovcnt && count < maxIovWindow; ++idx, ++count)
+    {
+        window[count].iov_base = (uint8_t *)iov[idx].iov_base + offset;
+        window[count].iov_len = iov[idx].iov_len - offset;
+        offset = 0;
+    }
+    return count;
+}
+
+void Socket::AdvanceIov(const struct iovec *iov, size_t iovcnt, size_t *idx, size_t *offset, size_t n)
+{
+    *offset += n;
+    // skip completed and empty buffers
+    while (*idx < iovcnt && *offset >= iov[*idx].iov_len)
+    {
+        *offset -= iov[*idx].iov_len;
+        ++*idx;
     }
-    return notfound;
 }
 
 bool Socket::IsValidDescriptor()
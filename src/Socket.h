@@ -4,28 +4,62 @@
 #include <stdexcept>
 #include <vector>
 #include <mutex>
+#include <condition_variable>
 #include <cstddef>
 #include <string>
 #include "NetworkUtils.h"
 #include "Address.h"
 #include "NanoException.h"
 #include <poll.h>
+#include <sys/uio.h>
 #include <memory>
+#include <atomic>
+#include <deque>
+#include <functional>
+
+class IoUring;
+
+/// I/O backend used by sockets for send/recv/accept
+enum class IoBackend
+{
+	/// Plain blocking syscalls
+	Default,
+	/// io_uring, each call submits one request on the plain descriptor and waits for it, a recv together with its
+	/// timeout instead of poll and recv. Nothing is batched across calls and no files or buffers are registered,
+	/// so it saves syscalls only where a timeout is used. Falls back to Default when the kernel lacks io_uring
+	IoUring
+};
+
+/// Datagram together with its remote address, used by the batched UDP calls
+struct Datagram
+{
+	std::shared_ptr<Address> address;
+	std::vector<uint8_t> data;
+};
 
 class Socket
 {
 public:
-	/// Creates tcp/udp socket object base on type (SOCK_STREAM / SOCK_DGRAM)
-	static std::shared_ptr<Socket> Create(int type);
+	/// Largest payload which a coalesced (GRO) or segmented (GSO) UDP buffer can carry
+	static const size_t maxCoalescedSize = 65507;
+	/// Maximum number of datagrams the kernel segments from one GSO send
+	static const size_t maxGsoSegments = 64;
+
+	/// Creates tcp/udp socket object base on type (SOCK_STREAM / SOCK_DGRAM), optionally in non-blocking mode
+	static std::shared_ptr<Socket> Create(int type, bool nonblocking = false);
 
 	/// Creates socket object using provided existing descriptor
 	Socket(int socket_descriptor);
 	Socket(const Socket &socket) = delete;
 	~Socket();
 
-	/// Gets the socket low level descriptor
+	/// Gets the socket low level descriptor, -1 once the socket is closed
 	int GetSocket();
 
+	/// Duplicates the descriptor (dup), the copy stays open when the socket is closed.
+	/// Returns -1 when the socket is closed, never a copy of a descriptor the process has reused meanwhile
+	int Duplicate();
+
 	/// Sets the socket low level descriptor
 	void SetSocket(int socket_descriptor);
 
@@ -38,52 +72,179 @@ public:
 	/// Disables read timeout
 	void DisableTimeout();
 
+	/// Switches the socket between blocking and non-blocking mode.
+	/// In non-blocking mode SendAll/RecvAll/RecvUntil still move all the data waiting for readiness when needed
+	void SetNonBlocking(bool nonblocking);
+
+	/// Checks if socket is in non-blocking mode
+	bool IsNonBlocking();
+
+	/// Sets the I/O backend used by sockets created from now on
+	static void SetDefaultIoBackend(IoBackend backend);
+
+	/// Sets the I/O backend of this socket
+	void SetIoBackend(IoBackend backend);
+
+	/// Gets the I/O backend which is effectively used by this socket
+	IoBackend GetIoBackend();
+
 	Address GetRemoteAddress();
 	std::shared_ptr<Address> GetBoundAddress();
 
+	/// Closes the descriptor, the socket does not refer to it anymore even when the process reuses it
 	void Close();
 	void Shutdown();
 
 	int GetSocketType();
 
+	/// Allows several sockets to bind the same address and port (SO_REUSEPORT), the kernel then spreads
+	/// connections or datagrams across them. Has to be called before Bind on every such socket
+	void EnableReusePort();
 	void Bind(std::shared_ptr<Address> address);
 	void Connect(std::shared_ptr<Address> address);
 	void Listen(int backlog);
 
-	/// Accept incoming connection and return back client socket
+	/// Accept incoming connection and return back client socket.
+	/// Returns nullptr when the socket is non-blocking and there is no pending connection.
+	/// Throws ResourceExhaustedException when there are no descriptors or memory left for the connection
 	std::shared_ptr<Socket> Accept();
 
 	// TCP
 	void SendAll(const std::string &data);
 	void SendAll(const std::vector<uint8_t> &data);
 	void SendAll(const uint8_t *buf, size_t len);
+	/// Sends all buffers as one stream using scatter/gather I/O, without concatenating them
+	void SendAllV(const struct iovec *iov, size_t iovcnt);
+	/// Sends length bytes of file fd starting at offset without copying them to user space
+	/// (sendfile, or splice through a pipe when sendfile is not supported for fd)
+	void SendFile(int fd, off_t offset, size_t length);
+	/// Enables MSG_ZEROCOPY sends (SO_ZEROCOPY) for SendAllZeroCopy payloads of at least threshold bytes.
+	/// Returns false when the kernel does not support zero copy for this socket
+	bool EnableZeroCopy(size_t threshold = defaultZeroCopyThreshold);
+	/// Sends whole buffer without copying it to the kernel when zero copy is enabled. The buffer must stay untouched
+	/// until onComplete is called, which may happen from a later call on this socket (see ReapZeroCopyCompletions),
+	/// or from a background thread when the socket is closed before the kernel is done with the buffer
+	void SendAllZeroCopy(const uint8_t *buf, size_t len, std::function<void()> onComplete);
+	/// Sends whole buffer without copying it, data is referenced until the kernel does not need it anymore
+	void SendAllZeroCopy(std::shared_ptr<const std::vector<uint8_t>> data);
+	/// Reads zero copy completions from the socket error queue and returns the number of sends still in flight.
+	/// When wait is true blocks until all sends complete
+	size_t ReapZeroCopyCompletions(bool wait);
 	std::string RecvAllString(size_t len);
 	std::vector<uint8_t> RecvAll(size_t len);
 	void RecvAll(uint8_t *buf, size_t len);
+	/// Fills all buffers in order from the stream using scatter/gather I/O
+	void RecvAllV(const struct iovec *iov, size_t iovcnt);
 	std::string RecvUntilString(const std::string pattern, size_t maxlen);
 	std::vector<uint8_t> RecvUntil(const std::string pattern, size_t maxlen);
 	std::vector<uint8_t> RecvUntil(const std::vector<uint8_t> &pattern, size_t maxlen);
 	void RecvUntil(uint8_t *buf, size_t buflen, const uint8_t *pattern, size_t patternlen, size_t *len);
 
+	/// Sends as much data as possible without blocking and returns the number of bytes sent,
+	/// 0 means that the operation would block
+	size_t TrySend(const std::string &data);
+	size_t TrySend(const uint8_t *buf, size_t len);
+	/// Sends as much of a message as possible without blocking and returns the number of bytes sent, 0 also when
+	/// another send is in progress. Once part of the message is sent the socket is reserved for the rest: the
+	/// blocking sends wait until further calls finish the message or ReleaseMessage is called, so nothing lands
+	/// in the middle of it. Only one caller at a time may send messages this way on a socket
+	size_t TrySendMessage(const uint8_t *buf, size_t len);
+	/// Gives the reservation of a partly sent message up, e.g. when the connection is dropped
+	void ReleaseMessage();
+
+	/// Receives available data without blocking and returns the number of bytes received,
+	/// 0 means that the operation would block. Throws SocketConnectionClosedException on end of stream
+	size_t TryRecv(uint8_t *buf, size_t len);
+
 	// UDP
 	void SendTo(const std::shared_ptr<Address> address, const std::string &data);
 	void SendTo(const std::shared_ptr<Address> address, const std::vector<uint8_t> &data);
 	void SendTo(const std::shared_ptr<Address> address, const uint8_t *buf, size_t len);
 	std::vector<uint8_t> RecvFrom(std::shared_ptr<Address> &address, size_t len);
 	size_t RecvFrom(std::shared_ptr<Address> &address, uint8_t *buf, size_t len);
+	/// Sends buf as consecutive datagrams of segmentSize bytes (the last one may be shorter) using UDP GSO,
+	/// so that the kernel segments up to 64 datagrams per syscall. Falls back to one sendto per datagram
+	void SendToSegmented(const std::shared_ptr<Address> address, const uint8_t *buf, size_t len, uint16_t segmentSize);
+	/// Enables UDP GRO, equal-sized datagrams of one flow may then be received coalesced by RecvFromCoalesced.
+	/// Returns false when the kernel does not support it
+	bool EnableGro();
+	/// Receives one datagram or, when GRO is enabled, a train of coalesced datagrams. segmentSize is set to
+	/// the size of each datagram in buf (the last one may be shorter), buf should hold maxCoalescedSize bytes
+	size_t RecvFromCoalesced(std::shared_ptr<Address> &address, uint8_t *buf, size_t len, size_t *segmentSize);
+	/// Sends all datagrams using as few syscalls as possible (sendmmsg)
+	void SendToBatch(const std::vector<Datagram> &datagrams);
+	/// Receives up to datagrams.size() datagrams of at most len bytes in one syscall (recvmmsg).
+	/// Waits for the first datagram only and returns the number of received ones, data buffers are reused
+	size_t RecvFromBatch(std::vector<Datagram> &datagrams, size_t len);
+	/// Receives up to count datagrams into caller prepared message headers (recvmmsg) without allocating,
+	/// msg_len of each received one is set. Waits for the first datagram only and returns the number of received ones
+	size_t RecvFromBatch(struct mmsghdr *msgs, size_t count);
 
 private:
-	int socket_descriptor;
+	std::atomic<int> socket_descriptor;
 	std::shared_ptr<Address> boundAddress;
 	std::shared_ptr<Address> connectedAddress;
 	std::mutex _send;
+	/// A message is partly sent by TrySendMessage, blocking sends wait on sendDone until it is finished
+	std::atomic<bool> messagePending;
+	std::condition_variable sendDone;
 	std::mutex _recv;
-	std::mutex _recvuntil;
 	int timeout;
+	static const size_t recvBufferSize = 16 * 1024;
+	static const size_t maxIovWindow = 64;
+	static const size_t defaultZeroCopyThreshold = 10 * 1024;
+	/// Received but not yet consumed bytes are kept in rbuf[rbegin, rend). A buffer grown beyond recvBufferSize
+	/// is released once it has been drained
+	std::vector<uint8_t> rbuf;
+	size_t rbegin;
+	size_t rend;
+	/// Entries of the ring each thread shares for the io_uring backend, a request and its timeout
+	static const unsigned ringEntries = 4;
+	static std::atomic<IoBackend> defaultIoBackend;
+	std::atomic<IoBackend> ioBackend;
+	std::atomic<bool> nonblocking;
+	std::atomic<bool> gsoUnsupported;
 
+	/// Zero copy send waiting for its completion notifications, the last one owns all following ids until sealed
+	struct ZeroCopySend
+	{
+		uint32_t first;
+		uint32_t count;
+		uint32_t completed;
+		bool sealed;
+		std::function<void()> onComplete;
+	};
+	std::mutex _zerocopy;
+	/// Payloads shorter than zeroCopyThreshold are copied, 0 means zero copy is disabled
+	std::atomic<size_t> zeroCopyThreshold;
+	/// Id the kernel assigns to the next MSG_ZEROCOPY send
+	uint32_t zeroCopyNextId;
+	std::deque<ZeroCopySend> zeroCopyPending;
+
+	std::unique_lock<std::mutex> LockSend();
 	void ApplyRecvTimeout();
+	void WaitForEvents(short events, int timeout);
 	int RecvTimeoutWrapper(void *buf, size_t len, int flags);
-	int IsContainPattern(const uint8_t *buf, size_t len, const uint8_t *pattern, size_t patternlen);
+	int SendWrapper(const void *buf, size_t len, int flags);
+	IoUring *GetRing();
+	int RingResult(int res);
+	size_t FillRecvBuffer(size_t minspace);
+	size_t ConsumeRecvBuffer(uint8_t *buf, size_t len);
+	size_t SendFileSendfile(int fd, off_t offset, size_t length);
+	void SendFileSplice(int fd, off_t offset, size_t length);
+	void ThrowSendError(const std::string &call);
+	size_t ReadZeroCopyCompletions(std::vector<std::function<void()>> &done);
+	void CompleteZeroCopy(uint32_t lo, uint32_t hi, std::vector<std::function<void()>> &done);
+	bool WaitForErrorQueue();
+	void SendZeroCopy(const uint8_t *buf, size_t len, std::function<void()> onComplete, std::vector<std::function<void()>> &done);
+	void SealZeroCopySend(std::vector<std::function<void()>> &done);
+	/// Releases the zero copy sends of the descriptor. With defer the sends still in flight are handed to a
+	/// background reaper that keeps a copy of the descriptor until they complete, returns true then
+	bool ReleaseZeroCopySends(bool defer);
+	static void DeferZeroCopyReap(std::shared_ptr<Socket> socket);
+	static void RunZeroCopyReaper();
+	static size_t FillIovWindow(const struct iovec *iov, size_t iovcnt, size_t idx, size_t offset, struct iovec *window);
+	static void AdvanceIov(const struct iovec *iov, size_t iovcnt, size_t *idx, size_t *offset, size_t n);
 	bool IsValidDescriptor();
 };
 
@@ -116,3 +277,10 @@ class TimeoutException : public SocketException
 public:
 	TimeoutException(std::string msg) : SocketException(msg) {}
 };
+
+/// The process or the system ran out of descriptors or memory, the call may succeed later
+class ResourceExhaustedException : public SocketException
+{
+public:
+	ResourceExhaustedException(std::string msg) : SocketException(msg) {}
+};
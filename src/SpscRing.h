@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+/// Bounded lock-free ring for exactly one producer and one consumer thread. Elements are written and read
+/// in place through Claim/Publish and Front/Pop, so that nothing is copied or allocated per element
+template <typename T>
+class SpscRing
+{
+public:
+	/// Creates ring, capacity is rounded up to a power of two
+	explicit SpscRing(size_t capacity);
+
+	/// Gets the slot for the next element, nullptr when the ring is full. Producer only
+	T *Claim();
+
+	/// Gets the slot ahead elements after the next one, so that several slots can be filled before they are
+	/// published. nullptr when the ring has no room for it. Producer only
+	T *Claim(size_t ahead);
+
+	/// Makes the claimed slot visible to the consumer. Producer only
+	void Publish();
+
+	/// Makes the next count claimed slots visible to the consumer at once. Producer only
+	void Publish(size_t count);
+
+	/// Gets the oldest element, nullptr when the ring is empty. Consumer only
+	T *Front();
+
+	/// Releases the element returned by Front, its slot may be claimed again. Consumer only
+	void Pop();
+
+	/// Checks whether there is no published element, may be called by any thread
+	bool Empty() const;
+
+	/// Gets approximate number of elements
+	size_t Size() const;
+
+private:
+	std::vector<T> slots;
+	size_t mask;
+	/// head is written by the consumer and tail by the producer, each side caches the index of the other
+	/// one on its own cache line and rereads it only when the cached value says full or empty
+	char pad0[64];
+	std::atomic<size_t> head;
+	size_t cachedTail;
+	char pad1[64];
+	std::atomic<size_t> tail;
+	size_t cachedHead;
+	char pad2[64];
+};
+
+template <typename T>
+SpscRing<T>::SpscRing(size_t capacity) : head(0), cachedTail(0), tail(0), cachedHead(0)
+{
+	size_t size = 1;
+	while (size < capacity)
+		size <<= 1;
+	slots = std::vector<T>(size);
+	mask = size - 1;
+}
+
+template <typename T>
+T *SpscRing<T>::Claim()
+{
+	return Claim(0);
+}
+
+template <typename T>
+T *SpscRing<T>::Claim(size_t ahead)
+{
+	size_t t = tail.load(std::memory_order_relaxed) + ahead;
+	if (t - cachedHead > mask)
+	{
+		cachedHead = head.load(std::memory_order_acquire);
+		if (t - cachedHead > mask)
+			return nullptr;
+	}
+	return &slots[t & mask];
+}
+
+template <typename T>
+void SpscRing<T>::Publish()
+{
+	Publish(1);
+}
+
+template <typename T>
+void SpscRing<T>::Publish(size_t count)
+{
+	tail.store(tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+}
+
+template <typename T>
+T *SpscRing<T>::Front()
+{
+	size_t h = head.load(std::memory_order_relaxed);
+	if (h == cachedTail)
+	{
+		cachedTail = tail.load(std::memory_order_acquire);
+		if (h == cachedTail)
+			return nullptr;
+	}
+	return &slots[h & mask];
+}
+
+template <typename T>
+void SpscRing<T>::Pop()
+{
+	head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+template <typename T>
+bool SpscRing<T>::Empty() const
+{
+	return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+}
+
+template <typename T>
+size_t SpscRing<T>::Size() const
+{
+	// head first, it never passes a tail read afterwards
+	size_t h = head.load(std::memory_order_acquire);
+	size_t t = tail.load(std::memory_order_acquire);
+	return t - h;
+}
\ No newline at end of file
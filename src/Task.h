@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/// Move-only callable used by ThreadPool. Callables of up to inlineSize bytes are stored in place,
+/// so that submitting a typical lambda does not touch the allocator. Bigger ones are moved to the heap
+class Task
+{
+public:
+	static const size_t inlineSize = 64;
+
+	Task() noexcept : ops(nullptr) {}
+
+	template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+	Task(F &&f) : ops(nullptr)
+	{
+		typedef typename std::decay<F>::type Callable;
+		Store<Callable>(std::forward<F>(f), std::integral_constant<bool, FitsInline<Callable>::value>());
+	}
+
+	Task(Task &&other) noexcept : ops(other.ops)
+	{
+		if (ops)
+		{
+			ops->move(storage, other.storage);
+			other.ops = nullptr;
+		}
+	}
+
+	Task &operator=(Task &&other) noexcept
+	{
+		if (this != &other)
+		{
+			Reset();
+			if (other.ops)
+			{
+				other.ops->move(storage, other.storage);
+				ops = other.ops;
+				other.ops = nullptr;
+			}
+		}
+		return *this;
+	}
+
+	Task(const Task &) = delete;
+	Task &operator=(const Task &) = delete;
+
+	~Task()
+	{
+		Reset();
+	}
+
+	/// Runs the stored callable
+	void operator()()
+	{
+		ops->invoke(storage);
+	}
+
+	/// Checks whether a callable is stored
+	explicit operator bool() const
+	{
+		return ops != nullptr;
+	}
+
+	/// Checks whether the callable is stored in place rather than on the heap
+	bool IsInline() const
+	{
+		return ops && ops->isInline;
+	}
+
+private:
+	struct Ops
+	{
+		void (*invoke)(void *storage);
+		/// Move constructs into dst and destroys the source
+		void (*move)(void *dst, void *src);
+		void (*destroy)(void *storage);
+		bool isInline;
+	};
+
+	template <typename F>
+	struct FitsInline
+	{
+		static const bool value = sizeof(F) <= inlineSize && alignof(std::max_align_t) % alignof(F) == 0 &&
+								  std::is_nothrow_move_constructible<F>::value;
+	};
+
+	template <typename F>
+	struct InlineOps
+	{
+		static void Invoke(void *storage) { (*static_cast<F *>(storage))(); }
+		static void Move(void *dst, void *src)
+		{
+			new (dst) F(std::move(*static_cast<F *>(src)));
+			static_cast<F *>(src)->~F();
+		}
+		static void Destroy(void *storage) { static_cast<F *>(storage)->~F(); }
+		static const Ops ops;
+	};
+
+	template <typename F>
+	struct HeapOps
+	{
+		static void Invoke(void *storage) { (**static_cast<F **>(storage))(); }
+		static void Move(void *dst, void *src) { *static_cast<F **>(dst) = *static_cast<F **>(src); }
+		static void Destroy(void *storage) { delete *static_cast<F **>(storage); }
+		static const Ops ops;
+	};
+
+	alignas(std::max_align_t) unsigned char storage[inlineSize];
+	const Ops *ops;
+
+	template <typename F, typename Arg>
+	void Store(Arg &&f, std::true_type)
+	{
+		new (storage) F(std::forward<Arg>(f));
+		ops = &InlineOps<F>::ops;
+	}
+
+	template <typename F, typename Arg>
+	void Store(Arg &&f, std::false_type)
+	{
+		*reinterpret_cast<F **>(storage) = new F(std::forward<Arg>(f));
+		ops = &HeapOps<F>::ops;
+	}
+
+	void Reset()
+	{
+		if (ops)
+		{
+			ops->destroy(storage);
+			ops = nullptr;
+		}
+	}
+};
+
+template <typename F>
+const Task::Ops Task::InlineOps<F>::ops = {&Task::InlineOps<F>::Invoke, &Task::InlineOps<F>::Move, &Task::InlineOps<F>::Destroy, true};
+
+template <typename F>
+const Task::Ops Task::HeapOps<F>::ops = {&Task::HeapOps<F>::Invoke, &Task::HeapOps<F>::Move, &Task::HeapOps<F>::Destroy, false};
\ No newline at end of file
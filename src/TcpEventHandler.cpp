@@ -0,0 +1,104 @@
+#include "TcpEventHandler.h"
+#include "TcpServer.h"
+
+TcpEventHandler::TcpEventHandler() : outpos(0), closing(false), outLimit(0), outPolicy(SlowConsumerPolicy::Disconnect), epfd(-1) {}
+
+TcpEventHandler::~TcpEventHandler() {}
+
+bool TcpEventHandler::Send(const std::string &data)
+{
+	return Send((const uint8_t *)data.data(), data.size());
+}
+
+bool TcpEventHandler::Send(const uint8_t *buf, size_t len)
+{
+	std::lock_guard<std::mutex> lock(_out);
+	if (closing)
+		return false;
+	if (len == 0)
+		return true;
+
+	bool pending = outpos < outbuf.size();
+	// checked before anything is sent, so that the client never gets part of the data only
+	if (outLimit > 0 && outbuf.size() - outpos + len > outLimit)
+	{
+		if (outPolicy == SlowConsumerPolicy::Disconnect)
+		{
+			// the event loop notices and closes the connection
+			closing = true;
+			try
+			{
+				socket->Shutdown();
+			}
+			catch (SocketException &e)
+			{
+			}
+		}
+		return false;
+	}
+	if (!pending)
+	{
+		outbuf.clear();
+		outpos = 0;
+		try
+		{
+			size_t n;
+			while (len > 0 && (n = socket->TrySend(buf, len)) > 0)
+			{
+				buf += n;
+				len -= n;
+			}
+		}
+		catch (SocketException &e)
+		{
+			// connection is broken, the event loop will notice it and clean up
+			closing = true;
+			socket->Shutdown();
+			return false;
+		}
+		if (len == 0)
+			return true;
+	}
+	outbuf.insert(outbuf.end(), buf, buf + len);
+	if (!pending)
+		server->WatchWritable(epfd, socket->GetSocket(), true);
+	return true;
+}
+
+void TcpEventHandler::Close()
+{
+	std::lock_guard<std::mutex> lock(_out);
+	if (closing)
+		return;
+	closing = true;
+	if (outpos >= outbuf.size())
+		socket->Shutdown();
+}
+
+bool TcpEventHandler::Flush()
+{
+	std::lock_guard<std::mutex> lock(_out);
+	while (outpos < outbuf.size())
+	{
+		size_t n = socket->TrySend(outbuf.data() + outpos, outbuf.size() - outpos);
+		if (n == 0)
+			return false;
+		outpos += n;
+	}
+	outbuf.clear();
+	outpos = 0;
+	server->WatchWritable(epfd, socket->GetSocket(), false);
+	if (closing)
+		socket->Shutdown();
+	return true;
+}
+
+void TcpEventHandler::SetSocket(std::shared_ptr<Socket> socket)
+{
+	this->socket = socket;
+}
+
+void TcpEventHandler::SetServer(std::shared_ptr<TcpServer> server)
+{
+	this->server = server;
+}
\ No newline at end of file
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "Socket.h"
+#include "BroadcastEngine.h"
+
+class TcpServer;
+
+/// Event driven counterpart of TcpConnectionHandler used by TcpServer in reactor mode.
+/// Callbacks are invoked on the event loop thread and must not block.
+class TcpEventHandler
+{
+public:
+	TcpEventHandler();
+	virtual ~TcpEventHandler();
+
+	/// Called once the connection has been accepted
+	virtual void OnConnect() {}
+
+	/// Called with data which has just been read from the socket
+	virtual void OnData(const uint8_t *data, size_t len) = 0;
+
+	/// Called when all queued data has been sent after the socket was not writable
+	virtual void OnWritable() {}
+
+	/// Called once the connection has been closed
+	virtual void OnDisconnect() {}
+
+	/// Queues data to be sent to the client, never blocks. Returns false when the data is not queued because the
+	/// connection is closing or the data does not fit into the output limit (see TcpServer::SetOutputLimit).
+	/// Data is either queued whole or not at all
+	bool Send(const std::string &data);
+	bool Send(const uint8_t *buf, size_t len);
+
+	/// Closes the connection once all queued data has been sent
+	void Close();
+
+	/// Sets the socket of tcp connection
+	void SetSocket(std::shared_ptr<Socket> socket);
+
+	/// Sets TcpServer object as context for handler
+	void SetServer(std::shared_ptr<TcpServer> server);
+
+protected:
+	std::shared_ptr<Socket> socket;
+	std::shared_ptr<TcpServer> server;
+
+private:
+	friend class TcpServer;
+
+	std::mutex _out;
+	std::vector<uint8_t> outbuf;
+	size_t outpos;
+	bool closing;
+	/// At most outLimit bytes wait in outbuf, 0 means unbounded
+	size_t outLimit;
+	SlowConsumerPolicy outPolicy;
+	/// epoll instance of the listener which serves the connection
+	int epfd;
+
+	/// Sends as much queued data as possible, returns true when nothing is left
+	bool Flush();
+};
\ No newline at end of file
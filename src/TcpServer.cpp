@@ -1,20 +1,54 @@
 #include "TcpServer.h"
+#include "CpuAffinity.h"
+#include <sys/epoll.h>
 
 std::shared_ptr<TcpServer> TcpServer::Create(std::function<std::shared_ptr<TcpConnectionHandler>()> connHandlerFactory)
 {
 	return std::shared_ptr<TcpServer>(new TcpServer(connHandlerFactory));
 }
 
+std::shared_ptr<TcpServer> TcpServer::CreateEventDriven(std::function<std::shared_ptr<TcpEventHandler>()> eventHandlerFactory)
+{
+	return std::shared_ptr<TcpServer>(new TcpServer(eventHandlerFactory));
+}
+
 TcpServer::TcpServer(std::function<std::shared_ptr<TcpConnectionHandler>()> connHandlerFactory)
 {
 	listening = false;
 	tpSize = defaultThreadPoolSize;
+	tpMaxSize = defaultThreadPoolSize;
+	executorLane = 0;
+	acceptErrors = 0;
+	outputLimit = defaultOutputLimit;
+	outputPolicy = SlowConsumerPolicy::Disconnect;
+	droppedBroadcasts = 0;
+	tpSpinWait = std::chrono::microseconds(0);
+	listenerCount = 1;
+	tpNumaSpread = false;
 	this->connHandlerFactory = connHandlerFactory;
 }
 
+TcpServer::TcpServer(std::function<std::shared_ptr<TcpEventHandler>()> eventHandlerFactory)
+{
+	listening = false;
+	tpSize = defaultThreadPoolSize;
+	tpMaxSize = defaultThreadPoolSize;
+	executorLane = 0;
+	acceptErrors = 0;
+	outputLimit = defaultOutputLimit;
+	outputPolicy = SlowConsumerPolicy::Disconnect;
+	droppedBroadcasts = 0;
+	tpSpinWait = std::chrono::microseconds(0);
+	listenerCount = 1;
+	tpNumaSpread = false;
+	this->eventHandlerFactory = eventHandlerFactory;
+}
+
 TcpServer::~TcpServer()
 {
 	Clean();
+	if (executor)
+		executor->RemoveLane(executorLane);
 }
 
 void TcpServer::Listen(uint16_t port)
@@ -35,61 +69,407 @@ void TcpServer::Listen(std::string ip, uint16_t port)
 
 void TcpServer::_Listen()
 {
-	tp = std::make_shared<ThreadPool>(tpSize);
-	socket = Socket::Create(SOCK_STREAM);
-	auto address = ip.empty() ? std::make_shared<Address>(port) : std::make_shared<Address>(ip, port);
-	ip = address->GetIP();
+	try
+	{
+		auto address = ip.empty() ? std::make_shared<Address>(port) : std::make_shared<Address>(ip, port);
+		ip = address->GetIP();
+
+		{
+			std::lock_guard<std::mutex> lock(_listeners);
+			for (int i = 0; i < listenerCount; ++i)
+			{
+				auto listener = std::make_shared<Listener>();
+				listener->epfd = -1;
+				listener->acceptPaused = false;
+				listener->socket = Socket::Create(SOCK_STREAM, (bool)eventHandlerFactory);
+				if (listenerCount > 1)
+					listener->socket->EnableReusePort();
+				listener->socket->Bind(address);
+				listener->socket->Listen(20);
+				listeners.push_back(listener);
+			}
+		}
 
-	socket->Bind(address);
-	socket->Listen(20);
+		if (!eventHandlerFactory)
+			CreateThreadPool();
 
-	listening = true;
-	halted = false;
+		listening = true;
+		halted = false;
 
+		if (listeners.size() == 1 && listenerCpus.empty())
+		{
+			RunListener(listeners[0], 0);
+		}
+		else
+		{
+			// every listener gets its own thread so that the calling one keeps its affinity
+			std::exception_ptr error;
+			std::mutex _error;
+			std::vector<std::thread> threads;
+			for (size_t i = 0; i < listeners.size(); ++i)
+			{
+				auto listener = listeners[i];
+				threads.emplace_back([this, listener, i, &error, &_error] {
+					try
+					{
+						RunListener(listener, i);
+					}
+					catch (...)
+					{
+						std::lock_guard<std::mutex> lock(_error);
+						if (!error)
+							error = std::current_exception();
+						// bring the other listeners down as well
+						Stop();
+					}
+				});
+			}
+			for (auto &thread : threads)
+				thread.join();
+			if (error)
+				std::rethrow_exception(error);
+		}
+	}
+	catch (...)
+	{
+		// listeners which were already created would be left bound and the server marked as listening
+		Clean();
+		throw;
+	}
+
+	Clean();
+}
+
+void TcpServer::RunListener(std::shared_ptr<Listener> listener, size_t index)
+{
+	if (!listenerCpus.empty())
+		CpuAffinity::PinCurrentThread(listenerCpus[index % listenerCpus.size()]);
+
+	if (eventHandlerFactory)
+		EventLoop(listener);
+	else
+		AcceptLoop(listener);
+}
+
+void TcpServer::AcceptLoop(std::shared_ptr<Listener> listener)
+{
 	while (!halted.load())
 	{
-		auto client_socket = socket->Accept();
+		std::shared_ptr<Socket> client_socket;
+		try
+		{
+			client_socket = listener->socket->Accept();
+		}
+		catch (ResourceExhaustedException &e)
+		{
+			// connections which are already served may free descriptors, keep the server up
+			++acceptErrors;
+			std::this_thread::sleep_for(std::chrono::milliseconds(acceptRetryDelay));
+			continue;
+		}
+		catch (SocketException &e)
+		{
+			// Stop shuts the listening socket down which fails accept
+			if (halted.load())
+				break;
+			throw;
+		}
 
 		if (halted.load())
 			break;
 
-		clients.push_back(client_socket);
+		AddClient(client_socket);
 		auto handler = connHandlerFactory();
 		handler->SetSocket(client_socket);
 		handler->SetServer(shared_from_this());
 
 		// handle connection
-		std::function<void()> task = [handler] {
+		tp->SubmitTask([handler = std::move(handler)] {
 			handler->HandleConnection();
-		};
-		tp->SubmitTask(task);
+		}, TaskPriority::Normal, std::chrono::steady_clock::time_point(), executorLane);
 	}
-	Clean();
+}
+
+void TcpServer::EventLoop(std::shared_ptr<Listener> listener)
+{
+	int listenfd = listener->socket->GetSocket();
+	listener->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (listener->epfd < 0)
+	{
+		std::string err(strerror(errno));
+		throw TcpServerException("epoll_create1 error: " + err);
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = listenfd;
+	if (epoll_ctl(listener->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+	{
+		std::string err(strerror(errno));
+		throw TcpServerException("epoll_ctl error: " + err);
+	}
+
+	std::vector<uint8_t> buf(readChunkSize);
+	struct epoll_event events[maxEvents];
+	try
+	{
+		while (!halted.load())
+		{
+			int timeout = -1;
+			if (listener->acceptPaused)
+			{
+				auto left = std::chrono::duration_cast<std::chrono::milliseconds>(listener->acceptResume - std::chrono::steady_clock::now());
+				timeout = std::max<int>(left.count(), 0);
+			}
+			int n = epoll_wait(listener->epfd, events, maxEvents, timeout);
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				std::string err(strerror(errno));
+				throw TcpServerException("epoll_wait error: " + err);
+			}
+			if (listener->acceptPaused && std::chrono::steady_clock::now() >= listener->acceptResume)
+				WatchListener(*listener, true);
+			for (int i = 0; i < n && !halted.load(); ++i)
+			{
+				if (events[i].data.fd == listenfd)
+					AcceptConnections(*listener);
+				else
+					HandleEvent(*listener, events[i].data.fd, events[i].events, buf);
+			}
+		}
+	}
+	catch (...)
+	{
+		CloseConnections(*listener);
+		throw;
+	}
+	CloseConnections(*listener);
+}
+
+void TcpServer::AcceptConnections(Listener &listener)
+{
+	std::shared_ptr<Socket> client_socket;
+	while (!halted.load())
+	{
+		try
+		{
+			if (!(client_socket = listener.socket->Accept()))
+				break;
+		}
+		catch (ResourceExhaustedException &e)
+		{
+			// the pending connection would wake the loop right away again, stop watching the listening socket
+			// for a while, closed connections may free descriptors meanwhile
+			++acceptErrors;
+			listener.acceptResume = std::chrono::steady_clock::now() + std::chrono::milliseconds(acceptRetryDelay);
+			WatchListener(listener, false);
+			break;
+		}
+
+		try
+		{
+			client_socket->SetNonBlocking(true);
+		}
+		catch (SocketException &e)
+		{
+			++acceptErrors;
+			continue;
+		}
+		auto handler = eventHandlerFactory();
+		handler->SetSocket(client_socket);
+		handler->SetServer(shared_from_this());
+		handler->epfd = listener.epfd;
+		handler->outLimit = outputLimit;
+		handler->outPolicy = outputPolicy;
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.fd = client_socket->GetSocket();
+		if (epoll_ctl(listener.epfd, EPOLL_CTL_ADD, client_socket->GetSocket(), &ev) < 0)
+		{
+			// only this connection is lost, the socket is closed once it is released
+			++acceptErrors;
+			continue;
+		}
+		AddClient(client_socket);
+		{
+			std::lock_guard<std::mutex> lock(listener._handlers);
+			listener.eventHandlers[client_socket->GetSocket()] = handler;
+		}
+
+		try
+		{
+			handler->OnConnect();
+		}
+		catch (std::exception &e)
+		{
+			CloseConnection(listener, client_socket->GetSocket());
+		}
+	}
+}
+
+void TcpServer::WatchListener(Listener &listener, bool enable)
+{
+	struct epoll_event ev;
+	ev.events = enable ? (uint32_t)EPOLLIN : 0;
+	ev.data.fd = listener.socket->GetSocket();
+	if (epoll_ctl(listener.epfd, EPOLL_CTL_MOD, ev.data.fd, &ev) < 0)
+	{
+		std::string err(strerror(errno));
+		throw TcpServerException("epoll_ctl error: " + err);
+	}
+	listener.acceptPaused = !enable;
+}
+
+void TcpServer::HandleEvent(Listener &listener, int fd, uint32_t events, std::vector<uint8_t> &buf)
+{
+	std::shared_ptr<TcpEventHandler> handler;
+	{
+		std::lock_guard<std::mutex> lock(listener._handlers);
+		auto it = listener.eventHandlers.find(fd);
+		if (it == listener.eventHandlers.end())
+			return;
+		handler = it->second;
+	}
+
+	try
+	{
+		if (events & EPOLLOUT)
+		{
+			if (handler->Flush())
+				handler->OnWritable();
+		}
+		if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		{
+			size_t n = handler->socket->TryRecv(buf.data(), buf.size());
+			if (n > 0)
+				handler->OnData(buf.data(), n);
+		}
+	}
+	catch (std::exception &e)
+	{
+		CloseConnection(listener, fd);
+	}
+}
+
+void TcpServer::CloseConnection(Listener &listener, int fd)
+{
+	std::shared_ptr<TcpEventHandler> handler;
+	{
+		std::lock_guard<std::mutex> lock(listener._handlers);
+		auto it = listener.eventHandlers.find(fd);
+		if (it == listener.eventHandlers.end())
+			return;
+		handler = it->second;
+		listener.eventHandlers.erase(it);
+	}
+
+	epoll_ctl(listener.epfd, EPOLL_CTL_DEL, fd, nullptr);
+	try
+	{
+		handler->OnDisconnect();
+	}
+	catch (std::exception &e)
+	{
+	}
+	try
+	{
+		Disconnect(handler->socket);
+	}
+	catch (SocketException &e)
+	{
+		// the peer may have already reset the connection
+	}
+}
+
+void TcpServer::CloseConnections(Listener &listener)
+{
+	// Notify handlers about connections which are still open
+	for (;;)
+	{
+		int fd;
+		{
+			std::lock_guard<std::mutex> lock(listener._handlers);
+			if (listener.eventHandlers.empty())
+				break;
+			fd = listener.eventHandlers.begin()->first;
+		}
+		CloseConnection(listener, fd);
+	}
+}
+
+void TcpServer::WatchWritable(int epfd, int fd, bool enable)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLRDHUP | (enable ? (uint32_t)EPOLLOUT : 0);
+	ev.data.fd = fd;
+	// the connection may have been closed in the meantime
+	epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void TcpServer::AddClient(std::shared_ptr<Socket> client)
+{
+	if (!clients.Add(client))
+		return;
+	// event handlers queue broadcasts in their output buffer, in order with their own data
+	if (broadcaster && !eventHandlerFactory)
+		broadcaster->Add(client);
+}
+
+void TcpServer::CreateThreadPool()
+{
+	if (executor)
+	{
+		tp = executor;
+		return;
+	}
+	tp = std::make_shared<ThreadPool>(tpSize, tpMaxSize, 0, OverflowPolicy::Block);
+	tp->SetSpinWait(tpSpinWait);
+	if (tpNumaSpread)
+		tp->SpreadWorkersAcrossNumaNodes();
+	else if (!tpCpus.empty())
+		tp->PinWorkers(tpCpus);
 }
 
 void TcpServer::Clean()
 {
-	if (socket)
-		socket.reset();
+	{
+		std::lock_guard<std::mutex> lock(_listeners);
+		for (auto &listener : listeners)
+		{
+			{
+				std::lock_guard<std::mutex> handlersLock(listener->_handlers);
+				listener->eventHandlers.clear();
+			}
+			if (listener->epfd >= 0)
+			{
+				close(listener->epfd);
+				listener->epfd = -1;
+			}
+		}
+		listeners.clear();
+	}
 
 	listening = false;
 
 	if (tp)
 		tp.reset();
 
-	clients.clear();
+	if (broadcaster)
+		broadcaster->Clear();
+	clients.Clear();
 }
 
 bool TcpServer::Disconnect(std::shared_ptr<Socket> client)
 {
-	auto it = std::find(std::begin(clients),std::end(clients), client);
-	if (it != std::end(clients))
-	{
-		(*it)->Shutdown();
-		clients.erase(it);
-		return true;
-	}
-	return false;
+	if (broadcaster)
+		broadcaster->Remove(client);
+	if (!clients.Remove(client))
+		return false;
+	client->Shutdown();
+	return true;
 }
 
 void TcpServer::Broadcast(std::string &data) const
@@ -99,23 +479,126 @@ void TcpServer::Broadcast(std::string &data) const
 
 void TcpServer::Broadcast(std::string &data, std::shared_ptr<Socket> socket) const
 {
-	for (size_t i = 0; i < clients.size(); ++i)
+	if (eventHandlerFactory)
 	{
-		if (clients[i] && (!socket || clients[i] != socket))
+		// queued behind data the handlers have already queued, the event loop sends it once the socket is writable
+		std::vector<std::shared_ptr<TcpEventHandler>> handlers;
 		{
-			clients[i]->SendAll(data);
+			std::lock_guard<std::mutex> lock(_listeners);
+			for (auto &listener : listeners)
+			{
+				std::lock_guard<std::mutex> handlersLock(listener->_handlers);
+				for (auto &entry : listener->eventHandlers)
+				{
+					if (!socket || entry.second->socket != socket)
+						handlers.push_back(entry.second);
+				}
+			}
 		}
+		for (auto &handler : handlers)
+		{
+			if (!handler->Send(data))
+				++droppedBroadcasts;
+		}
+		return;
 	}
+
+	if (broadcaster)
+	{
+		broadcaster->Broadcast(std::make_shared<const std::vector<uint8_t>>(data.begin(), data.end()), socket);
+		return;
+	}
+
+	auto recipients = clients.Snapshot();
+	for (size_t i = 0; i < recipients.size(); ++i)
+	{
+		if (recipients[i] && (!socket || recipients[i] != socket))
+		{
+			recipients[i]->SendAll(data);
+		}
+	}
+}
+
+void TcpServer::SetAsyncBroadcast(int flushThreads, size_t maxQueuedMessages, SlowConsumerPolicy policy)
+{
+	broadcaster = std::make_shared<BroadcastEngine>(flushThreads, maxQueuedMessages, policy);
+}
+
+size_t TcpServer::GetAcceptErrors()
+{
+	return acceptErrors.load();
+}
+
+size_t TcpServer::GetDroppedBroadcasts()
+{
+	return droppedBroadcasts.load() + (broadcaster ? broadcaster->GetDroppedMessages() : 0);
+}
+
+void TcpServer::SetOutputLimit(size_t maxQueuedBytes, SlowConsumerPolicy policy)
+{
+	// there are no message boundaries in the output buffer to coalesce at
+	if (policy == SlowConsumerPolicy::Coalesce)
+		throw TcpServerException("Coalesce is not supported for the output buffer");
+	outputLimit = maxQueuedBytes;
+	outputPolicy = policy;
 }
 
 void TcpServer::SetThreadPoolSize(int size)
 {
 	tpSize = size;
+	tpMaxSize = size;
+}
+
+void TcpServer::SetThreadPoolSize(int minSize, int maxSize)
+{
+	tpSize = minSize;
+	tpMaxSize = maxSize;
+}
+
+void TcpServer::SetThreadPoolSpinWait(std::chrono::microseconds spin)
+{
+	tpSpinWait = spin;
 }
 
 size_t TcpServer::GetNumberOfConnections()
 {
-	return clients.size();
+	return clients.Size();
+}
+
+void TcpServer::SetListenerCount(int count)
+{
+	listenerCount = std::max(count, 1);
+}
+
+void TcpServer::SetListenerAffinity(bool pin)
+{
+	listenerCpus = pin ? CpuAffinity::GetAllowedCpus() : std::vector<int>();
+}
+
+void TcpServer::SetListenerCpus(const std::vector<int> &cpus)
+{
+	listenerCpus = cpus;
+}
+
+void TcpServer::SetThreadPoolCpus(const std::vector<int> &cpus)
+{
+	tpCpus = cpus;
+}
+
+void TcpServer::SetThreadPoolNumaSpread(bool spread)
+{
+	tpNumaSpread = spread;
+}
+
+void TcpServer::SetExecutor(std::shared_ptr<ThreadPool> executor)
+{
+	// the lane stays with the server as long as the executor does
+	if (executor == this->executor)
+		return;
+	if (this->executor)
+		this->executor->RemoveLane(executorLane);
+	this->executor = executor;
+	executorLane = executor ? executor->AddLane() : 0;
 }
 
 void TcpServer::Stop()
@@ -123,17 +606,23 @@ void TcpServer::Stop()
 	halted = true;
 
 	// Disconnect all connections
-	for (size_t i = 0; i < clients.size(); ++i)
+	for (auto &client : clients.Snapshot())
 	{
-		if (clients[i])
+		client->Shutdown();
+	}
+
+	// Shut the listening sockets down to unblock accept and epoll_wait of every listener
+	std::lock_guard<std::mutex> lock(_listeners);
+	for (auto &listener : listeners)
+	{
+		try
+		{
+			listener->socket->Shutdown();
+		}
+		catch (SocketException &e)
 		{
-			clients[i]->Shutdown();
 		}
 	}
-
-	// Connect to this server to unblock accept syscall
-	auto s = Socket::Create(SOCK_STREAM);
-	s->Connect(std::make_shared<Address>(this->ip, this->port));
 }
 
 bool TcpServer::IsListening()
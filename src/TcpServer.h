@@ -4,9 +4,14 @@
 #include <algorithm>
 #include "Address.h"
 #include "TcpConnectionHandler.h"
+#include "TcpEventHandler.h"
 #include "ThreadPool.h"
+#include "ClientRegistry.h"
+#include "BroadcastEngine.h"
 #include <functional>
 #include "NanoException.h"
+#include <unordered_map>
+#include <exception>
 
 class TcpServer : public std::enable_shared_from_this<TcpServer>
 {
@@ -14,6 +19,10 @@ public:
 	/// Creates tcp server
 	static std::shared_ptr<TcpServer> Create(std::function<std::shared_ptr<TcpConnectionHandler>()> connHandlerFactory);
 
+	/// Creates tcp server working in reactor mode: all sockets are served by a single epoll loop
+	/// and the number of concurrent connections is not limited by the thread pool size
+	static std::shared_ptr<TcpServer> CreateEventDriven(std::function<std::shared_ptr<TcpEventHandler>()> eventHandlerFactory);
+
 	~TcpServer();
 
 	/// Bind to all interfaces on the provided port and listen on incoming connections
@@ -28,38 +37,151 @@ public:
 	/// Disconnect client socket
 	bool Disconnect(std::shared_ptr<Socket> client);
 
-	/// Sends data to all clients
+	/// Sends data to all clients. In reactor mode the data is queued on every event handler behind what the
+	/// handler has queued itself and sent by the event loop, so Broadcast does not block
 	void Broadcast(std::string &data) const;
 
 	/// Sends data to all clients except provided socket
 	void Broadcast(std::string &data, std::shared_ptr<Socket> socket) const;
 
+	/// Makes Broadcast return right away: the data is copied once into a shared buffer, queued for every client
+	/// and sent by flushThreads background threads, so a slow client does not hold back the others. At most
+	/// maxQueuedMessages messages wait per client, policy decides what happens to clients which fall behind.
+	/// Applies to clients which connect afterwards, call it before Listen. Event driven servers queue broadcasts
+	/// in the output buffers of their handlers instead, which never block either
+	void SetAsyncBroadcast(int flushThreads, size_t maxQueuedMessages, SlowConsumerPolicy policy);
+
+	/// Gets the number of broadcast messages which were dropped or coalesced for slow clients
+	size_t GetDroppedBroadcasts();
+
+	/// Limits the data waiting in the output buffer of an event handler to maxQueuedBytes, policy decides what
+	/// happens to a Send which does not fit: Drop refuses it, Disconnect also shuts the connection down. Coalesce
+	/// is not supported for byte streams. Applies to connections accepted afterwards, 0 means unbounded
+	void SetOutputLimit(size_t maxQueuedBytes, SlowConsumerPolicy policy);
+
 	/// Sets the number of threads in the pool which are used for handling incoming connections
 	void SetThreadPoolSize(int size);
 
+	/// Sets elastic thread pool size, workers are added while tasks wait with every worker busy
+	/// and retire after being idle for a while
+	void SetThreadPoolSize(int minSize, int maxSize);
+
+	/// Lets idle thread pool workers spin for up to the given time before they park, which cuts the
+	/// handoff latency of tasks at the cost of cpu time. 0 disables spinning
+	void SetThreadPoolSpinWait(std::chrono::microseconds spin);
+
 	/// Gets the number of tcp connections
 	size_t GetNumberOfConnections();
 
+	/// Gets the number of times accepting failed for lack of descriptors or memory, or an accepted connection
+	/// could not be set up and was dropped. The server keeps running and retries accepting after a short delay
+	size_t GetAcceptErrors();
+
+	/// Sets the number of listening sockets bound to the same port with SO_REUSEPORT. Each of them is served
+	/// by its own accept loop (or event loop in reactor mode) on its own thread and the kernel spreads
+	/// incoming connections across them
+	void SetListenerCount(int count);
+
+	/// Pins the thread of the n-th listener to the n-th cpu the process may run on
+	void SetListenerAffinity(bool pin);
+
+	/// Pins the thread of the n-th listener to cpus[n % cpus.size()], separately from the thread pool workers
+	void SetListenerCpus(const std::vector<int> &cpus);
+
+	/// Pins the n-th thread pool worker to cpus[n % cpus.size()]
+	void SetThreadPoolCpus(const std::vector<int> &cpus);
+
+	/// Spreads thread pool workers evenly across NUMA nodes
+	void SetThreadPoolNumaSpread(bool spread);
+
+	/// Handles connections on the given pool instead of creating one, so that several servers share one right-sized
+	/// pool. The server gets its own lane in the pool, lanes are served in turns. The thread pool settings of
+	/// the server do not apply, and stopping the server does not wait for its running tasks. nullptr restores
+	/// the own pool
+	void SetExecutor(std::shared_ptr<ThreadPool> executor);
+
 	/// Stops tcp server
 	void Stop();
 
 private:
+	/// Listening socket together with the state of the loop which serves it
+	struct Listener
+	{
+		std::shared_ptr<Socket> socket;
+		int epfd;
+		std::unordered_map<int, std::shared_ptr<TcpEventHandler>> eventHandlers;
+		/// Guards eventHandlers, which are changed by the loop thread and read by Broadcast from any thread
+		std::mutex _handlers;
+		/// The listening socket is left out of epoll until then, after accept ran out of descriptors or memory
+		std::chrono::steady_clock::time_point acceptResume;
+		bool acceptPaused;
+	};
+
 	static const int defaultThreadPoolSize = 20;
 	int tpSize;
+	int tpMaxSize;
+	std::chrono::microseconds tpSpinWait;
+	int listenerCount;
+	/// The n-th listener thread is pinned to listenerCpus[n % size], empty means no pinning
+	std::vector<int> listenerCpus;
+	std::vector<int> tpCpus;
+	bool tpNumaSpread;
 	std::shared_ptr<ThreadPool> tp;
-	std::shared_ptr<Socket> socket;
-	std::vector<std::shared_ptr<Socket>> clients;
+	std::shared_ptr<ThreadPool> executor;
+	size_t executorLane;
+	std::atomic<size_t> acceptErrors;
+	size_t outputLimit;
+	SlowConsumerPolicy outputPolicy;
+	/// Broadcasts refused by the output limit of event handlers
+	mutable std::atomic<size_t> droppedBroadcasts;
+	std::vector<std::shared_ptr<Listener>> listeners;
+	mutable std::mutex _listeners;
+	ClientRegistry clients;
+	std::shared_ptr<BroadcastEngine> broadcaster;
 	std::function<std::shared_ptr<TcpConnectionHandler>()> connHandlerFactory;
+	std::function<std::shared_ptr<TcpEventHandler>()> eventHandlerFactory;
 	uint16_t port;
 	std::string ip;
 	std::atomic<bool> halted;
 	std::atomic<bool> listening;
 
+	static const int maxEvents = 128;
+	static const size_t readChunkSize = 64 * 1024;
+	/// Milliseconds to wait before accepting again when there are no descriptors or memory left
+	static const int acceptRetryDelay = 100;
+	static const size_t defaultOutputLimit = 64 * 1024 * 1024;
+
+	friend class TcpEventHandler;
+
 	void _Listen();
 
+	void RunListener(std::shared_ptr<Listener> listener, size_t index);
+
+	void AcceptLoop(std::shared_ptr<Listener> listener);
+
+	void EventLoop(std::shared_ptr<Listener> listener);
+
+	void AcceptConnections(Listener &listener);
+
+	void WatchListener(Listener &listener, bool enable);
+
+	void HandleEvent(Listener &listener, int fd, uint32_t events, std::vector<uint8_t> &buf);
+
+	void CloseConnection(Listener &listener, int fd);
+
+	void CloseConnections(Listener &listener);
+
+	void WatchWritable(int epfd, int fd, bool enable);
+
+	void AddClient(std::shared_ptr<Socket> client);
+
+	void CreateThreadPool();
+
 	void Clean();
 
 	TcpServer(std::function<std::shared_ptr<TcpConnectionHandler>()> connHandlerFactory);
+
+	TcpServer(std::function<std::shared_ptr<TcpEventHandler>()> eventHandlerFactory);
 };
 
 class TcpServerException : public NanoException
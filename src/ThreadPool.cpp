@@ -1,8 +1,43 @@
 #include "ThreadPool.h"
+#include "CpuAffinity.h"
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-ThreadPool::ThreadPool(int size) : halted(false)
+thread_local ThreadPool::Worker *ThreadPool::currentWorker = nullptr;
+thread_local ThreadPool *ThreadPool::currentPool = nullptr;
+
+/// Spin iterations with a cpu pause before spinning workers start to yield the cpu
+static const int spinsBeforeYield = 64;
+
+static inline void CpuRelax()
 {
-    createThreadPool(size);
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+ThreadPool::ThreadPool(int size) : ThreadPool(size, 0, OverflowPolicy::Block)
+{
+}
+
+ThreadPool::ThreadPool(int size, size_t capacity, OverflowPolicy policy) : ThreadPool(size, size, capacity, policy)
+{
+}
+
+ThreadPool::ThreadPool(int minSize, int maxSize, size_t capacity, OverflowPolicy policy)
+    : minWorkers(minSize), liveWorkers(0), growthThresholdUs(defaultGrowthThresholdUs), idleTimeoutMs(defaultIdleTimeoutMs),
+      startedTasks(0), highQueue(priorityQueueCapacity), lowQueue(priorityQueueCapacity), laneCount(1),
+      pendingTasks(0), sleepers(0), spinning(0), spinWaitUs(0), halted(false), capacity(capacity), policy(policy), droppedTasks(0),
+      callerRunTasks(0), expiredTasks(0), blockedSubmitters(0)
+{
+    lanes[0].reset(new InjectionQueue(workerQueueCapacity));
+    std::fill(laneInUse, laneInUse + maxLanes, false);
+    laneInUse[0] = true;
+    createThreadPool(minSize, std::max(minSize, maxSize));
 }
 
 ThreadPool::~ThreadPool()
@@ -10,51 +45,565 @@ ThreadPool::~ThreadPool()
     Shutdown();
 }
 
-void ThreadPool::SubmitTask(std::function<void()> task)
+void ThreadPool::SubmitTask(Task task)
 {
-    std::unique_lock<std::mutex> lock(task_queue_mtx);
-    task_queue.push(task);
-    cond.notify_one();
+    SubmitTask(std::move(task), TaskPriority::Normal, std::chrono::steady_clock::time_point());
+}
+
+void ThreadPool::SubmitTask(Task task, TaskPriority priority)
+{
+    SubmitTask(std::move(task), priority, std::chrono::steady_clock::time_point());
+}
+
+void ThreadPool::SubmitTask(Task task, TaskPriority priority, std::chrono::steady_clock::time_point deadline)
+{
+    SubmitTask(std::move(task), priority, deadline, 0);
+}
+
+void ThreadPool::SubmitTask(Task task, TaskPriority priority, std::chrono::steady_clock::time_point deadline, size_t lane)
+{
+    bool isWorker = currentPool == this;
+    if (!reserve())
+    {
+        // the queue is full
+        OverflowPolicy overflow = policy == OverflowPolicy::Block && isWorker ? OverflowPolicy::CallerRuns : policy;
+        switch (overflow)
+        {
+        case OverflowPolicy::Block:
+        {
+            bool reserved = false;
+            std::unique_lock<std::mutex> lock(not_full_mtx);
+            ++blockedSubmitters;
+            not_full.wait(lock, [this, &reserved] { return halted.load() || (reserved = reserve()); });
+            --blockedSubmitters;
+            // nobody takes tasks after shutdown, the task is queued like before the limit existed
+            if (!reserved)
+                ++pendingTasks;
+            break;
+        }
+        case OverflowPolicy::DropNewest:
+            ++droppedTasks;
+            return;
+        case OverflowPolicy::DropOldest:
+        {
+            // the dropped task hands its place over to the submitted one, high priority tasks are kept
+            Task oldest;
+            size_t cursor = lane;
+            if (popInjected(lowQueue, oldest) || popLanes(cursor, oldest) || steal(nullptr, oldest))
+                ++droppedTasks;
+            else
+                ++pendingTasks;
+            break;
+        }
+        case OverflowPolicy::CallerRuns:
+            ++callerRunTasks;
+            task();
+            return;
+        }
+    }
+
+    // workers keep normal tasks they spawn local, everything else goes through the injection queues
+    bool local = isWorker && priority == TaskPriority::Normal && deadline == std::chrono::steady_clock::time_point();
+    if (!local || !currentWorker->deque.Push(std::move(task)))
+    {
+        pushInjected(queueFor(priority, lane), std::move(task), deadline);
+    }
+    wakeWorker();
+}
+
+void ThreadPool::SubmitTasks(std::vector<Task> &tasks, size_t lane)
+{
+    bool isWorker = currentPool == this;
+    size_t reserved = reserve(tasks.size());
+    size_t i = 0;
+    if (isWorker)
+    {
+        while (i < reserved && currentWorker->deque.Push(std::move(tasks[i])))
+            ++i;
+    }
+    if (i < reserved)
+    {
+        InjectionQueue &queue = queueFor(TaskPriority::Normal, lane);
+        std::lock_guard<std::mutex> lock(queue.mtx);
+        for (; i < reserved; ++i)
+            pushInjectedLocked(queue, std::move(tasks[i]), std::chrono::steady_clock::time_point());
+    }
+    wakeWorkers(reserved);
+
+    // tasks which did not fit go through the overflow policy one by one
+    for (; i < tasks.size(); ++i)
+        SubmitTask(std::move(tasks[i]), TaskPriority::Normal, std::chrono::steady_clock::time_point(), lane);
+    tasks.clear();
 }
 
 void ThreadPool::Shutdown()
 {
-    std::unique_lock<std::mutex> lock(task_queue_mtx);
+    std::unique_lock<std::mutex> lock(park_mtx);
     if (!halted.load())
     {   
         halted.store(true);
         cond.notify_all();
         lock.unlock();
-        for (size_t i = 0; i < workers.size(); ++i)
         {
-            workers[i].join();
+            std::lock_guard<std::mutex> blocked(not_full_mtx);
+            not_full.notify_all();
+        }
+        if (monitor.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> monitorLock(monitor_mtx);
+                monitor_cond.notify_all();
+            }
+            monitor.join();
+        }
+        {
+            std::lock_guard<std::mutex> resize(resize_mtx);
+            for (size_t i = 0; i < workers.size(); ++i)
+            {
+                if (workers[i]->thread.joinable())
+                    workers[i]->thread.join();
+            }
+        }
+        // an elastic pool may have retired its last worker while tasks were queued
+        Task task;
+        size_t cursor = 0;
+        while (popInjected(highQueue, task) || popLanes(cursor, task) || popInjected(lowQueue, task))
+        {
+            release();
+            task();
         }
     }
 }
 
+size_t ThreadPool::AddLane()
+{
+    std::lock_guard<std::mutex> lock(lane_mtx);
+    size_t count = laneCount.load();
+    for (size_t lane = 1; lane < count; ++lane)
+    {
+        if (!laneInUse[lane])
+        {
+            laneInUse[lane] = true;
+            return lane;
+        }
+    }
+    if (count == maxLanes)
+        return 0;
+    lanes[count].reset(new InjectionQueue(priorityQueueCapacity));
+    laneInUse[count] = true;
+    laneCount.store(count + 1);
+    return count;
+}
+
+void ThreadPool::RemoveLane(size_t lane)
+{
+    // the default lane is shared by everyone
+    if (lane == 0)
+        return;
+    std::lock_guard<std::mutex> lock(lane_mtx);
+    if (lane < laneCount.load())
+        laneInUse[lane] = false;
+}
+
 bool ThreadPool::isHalted()
 {
     return halted.load();
 }
 
-void ThreadPool::createThreadPool(int size)
+void ThreadPool::PinWorkers(const std::vector<int> &cpus)
+{
+    std::vector<std::vector<int>> sets;
+    for (int cpu : cpus)
+        sets.push_back(std::vector<int>(1, cpu));
+    setPlacement(sets);
+}
+
+void ThreadPool::SpreadWorkersAcrossNumaNodes()
 {
-    for (int i = 0; i < size; ++i)
+    setPlacement(CpuAffinity::GetNumaNodes());
+}
+
+void ThreadPool::setPlacement(std::vector<std::vector<int>> sets)
+{
+    std::lock_guard<std::mutex> resize(resize_mtx);
+    std::lock_guard<std::mutex> lock(placement_mtx);
+    placement = sets;
+    if (placement.empty())
+        return;
+    for (auto &worker : workers)
     {
-        workers.emplace_back([this] {
-            for (;;)
-            {
-                std::function<void()> task;
-                {
-                    std::unique_lock<std::mutex> lock(task_queue_mtx);
-                    cond.wait(lock, [this] { return halted.load() || !task_queue.empty(); });
-                    if (halted.load() && task_queue.empty())
-                        break;
-                    task = std::move(task_queue.front());
-                    task_queue.pop();
-                }
-                task();
-            }
-        });
+        if (worker->running.load())
+            CpuAffinity::PinThread(worker->thread.native_handle(), placement[worker->index % placement.size()]);
+    }
+}
+
+void ThreadPool::SetGrowthThreshold(std::chrono::microseconds threshold)
+{
+    growthThresholdUs.store(threshold.count());
+}
+
+void ThreadPool::SetIdleTimeout(std::chrono::milliseconds timeout)
+{
+    idleTimeoutMs.store(timeout.count());
+}
+
+void ThreadPool::SetSpinWait(std::chrono::microseconds spin)
+{
+    spinWaitUs.store(spin.count());
+}
+
+int ThreadPool::GetWorkerCount()
+{
+    return liveWorkers.load();
+}
+
+size_t ThreadPool::GetDroppedTasks()
+{
+    return droppedTasks.load();
+}
+
+size_t ThreadPool::GetExpiredTasks()
+{
+    return expiredTasks.load();
+}
+
+size_t ThreadPool::GetCallerRunTasks()
+{
+    return callerRunTasks.load();
+}
+
+void ThreadPool::createThreadPool(int minSize, int maxSize)
+{
+    // all workers exist before any of them starts stealing
+    for (int i = 0; i < maxSize; ++i)
+    {
+        workers.emplace_back(new Worker(workerQueueCapacity, i, 2654435761u * (i + 1)));
+    }
+    grow(minSize);
+    if (isElastic())
+        monitor = std::thread([this] { runMonitor(); });
+}
+
+bool ThreadPool::isElastic()
+{
+    return workers.size() > (size_t)minWorkers;
+}
+
+void ThreadPool::grow(size_t count)
+{
+    std::lock_guard<std::mutex> lock(resize_mtx);
+    for (size_t i = 0; i < workers.size() && count > 0 && !halted.load(); ++i)
+    {
+        Worker *worker = workers[i].get();
+        if (worker->running.load())
+            continue;
+        // the slot of a retired worker, its thread has finished or is about to
+        if (worker->thread.joinable())
+            worker->thread.join();
+        worker->running.store(true);
+        ++liveWorkers;
+        worker->thread = std::thread([this, worker] { runWorker(worker); });
+        --count;
+    }
+}
+
+bool ThreadPool::retire()
+{
+    int live = liveWorkers.load();
+    do
+    {
+        if (live <= minWorkers)
+            return false;
+    } while (!liveWorkers.compare_exchange_weak(live, live - 1));
+    return true;
+}
+
+void ThreadPool::runMonitor()
+{
+    size_t lastStarted = startedTasks.load();
+    auto lastProgress = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(monitor_mtx);
+    while (!halted.load())
+    {
+        std::chrono::microseconds threshold(growthThresholdUs.load());
+        if (monitor_cond.wait_for(lock, std::max(threshold / 4, std::chrono::microseconds(1000)), [this] { return halted.load(); }))
+            break;
+        size_t started = startedTasks.load();
+        size_t pending = pendingTasks.load();
+        auto now = std::chrono::steady_clock::now();
+        if (started != lastStarted || pending == 0)
+        {
+            lastStarted = started;
+            lastProgress = now;
+            continue;
+        }
+        // idle workers would have taken a task, so every worker is busy and the oldest queued
+        // task has waited at least since the last start. One worker per waiting task clears the backlog
+        if (now - lastProgress >= threshold)
+        {
+            grow(pending);
+            lastProgress = now;
+        }
+    }
+}
+
+void ThreadPool::runWorker(Worker *worker)
+{
+    currentWorker = worker;
+    currentPool = this;
+    {
+        std::lock_guard<std::mutex> lock(placement_mtx);
+        if (!placement.empty())
+            CpuAffinity::PinCurrentThread(placement[worker->index % placement.size()]);
+    }
+    bool elastic = isElastic();
+    bool wasIdle = false;
+    for (;;)
+    {
+        Task task;
+        bool spun = false;
+        if (findTask(worker, task) || (spun = spin(worker, task)))
+        {
+            if (elastic)
+                startedTasks.fetch_add(1, std::memory_order_relaxed);
+            release();
+            // submitters skip the wakeup while a worker spins, so a worker coming back from spinning
+            // or parking passes the wakeup on when more tasks are waiting
+            if ((wasIdle || spun) && pendingTasks.load() > 0)
+                wakeWorker();
+            wasIdle = false;
+            task();
+            continue;
+        }
+        wasIdle = true;
+        std::unique_lock<std::mutex> lock(park_mtx);
+        // a submitter increments pendingTasks before it looks for sleepers, so either it sees
+        // this worker sleeping or the worker sees the task
+        ++sleepers;
+        auto ready = [this] { return halted.load() || pendingTasks.load() > 0; };
+        bool woken = true;
+        if (elastic)
+            woken = cond.wait_for(lock, std::chrono::milliseconds(idleTimeoutMs.load()), ready);
+        else
+            cond.wait(lock, ready);
+        --sleepers;
+        if (halted.load() && pendingTasks.load() == 0)
+            break;
+        // the own deque is empty, nothing is lost when the worker leaves
+        if (!woken && !halted.load() && retire())
+            break;
+    }
+    currentWorker = nullptr;
+    currentPool = nullptr;
+    worker->running.store(false);
+}
+
+bool ThreadPool::reserve()
+{
+    if (capacity == 0)
+    {
+        ++pendingTasks;
+        return true;
+    }
+    size_t pending = pendingTasks.load();
+    do
+    {
+        if (pending >= capacity)
+            return false;
+    } while (!pendingTasks.compare_exchange_weak(pending, pending + 1));
+    return true;
+}
+
+size_t ThreadPool::reserve(size_t count)
+{
+    if (capacity == 0)
+    {
+        pendingTasks += count;
+        return count;
+    }
+    size_t pending = pendingTasks.load();
+    size_t reserved;
+    do
+    {
+        reserved = pending >= capacity ? 0 : std::min(count, capacity - pending);
+        if (reserved == 0)
+            return 0;
+    } while (!pendingTasks.compare_exchange_weak(pending, pending + reserved));
+    return reserved;
+}
+
+void ThreadPool::release()
+{
+    --pendingTasks;
+    // same handshake as with sleeping workers, blocked submitters register before they check the queue
+    if (blockedSubmitters.load() > 0)
+    {
+        std::lock_guard<std::mutex> lock(not_full_mtx);
+        not_full.notify_one();
+    }
+}
+
+bool ThreadPool::findTask(Worker *worker, Task &task)
+{
+    return popInjected(highQueue, task) || worker->deque.Pop(task) || popLanes(worker->nextLane, task) || steal(worker, task) ||
+           popInjected(lowQueue, task);
+}
+
+bool ThreadPool::spin(Worker *worker, Task &task)
+{
+    int64_t spinUs = spinWaitUs.load();
+    if (spinUs <= 0 || spinning.load() * 2 >= liveWorkers.load())
+        return false;
+    // the spinner stops counting itself before it registers as sleeper and checks pendingTasks,
+    // so a submitter which skipped the wakeup because of it is always seen
+    ++spinning;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(spinUs);
+    bool found = false;
+    for (int i = 0; !halted.load(); ++i)
+    {
+        if (pendingTasks.load() > 0 && findTask(worker, task))
+        {
+            found = true;
+            break;
+        }
+        if (i < spinsBeforeYield)
+            CpuRelax();
+        else
+            std::this_thread::yield();
+        if (std::chrono::steady_clock::now() >= deadline)
+            break;
+    }
+    --spinning;
+    return found;
+}
+
+ThreadPool::InjectionQueue &ThreadPool::queueFor(TaskPriority priority, size_t lane)
+{
+    switch (priority)
+    {
+    case TaskPriority::High:
+        return highQueue;
+    case TaskPriority::Low:
+        return lowQueue;
+    default:
+        return *lanes[lane < laneCount.load() ? lane : 0];
+    }
+}
+
+bool ThreadPool::popLanes(size_t &cursor, Task &task)
+{
+    size_t count = laneCount.load();
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t lane = (cursor + i) % count;
+        if (popInjected(*lanes[lane], task))
+        {
+            // the next look starts behind the served lane
+            cursor = lane + 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::pushInjected(InjectionQueue &queue, Task &&task, std::chrono::steady_clock::time_point deadline)
+{
+    std::lock_guard<std::mutex> lock(queue.mtx);
+    pushInjectedLocked(queue, std::move(task), deadline);
+}
+
+void ThreadPool::pushInjectedLocked(InjectionQueue &queue, Task &&task, std::chrono::steady_clock::time_point deadline)
+{
+    size_t size = queue.size.load();
+    if (size == queue.ring.size())
+    {
+        // unroll the ring into a twice as big one
+        std::vector<QueuedTask> grown(queue.ring.size() * 2);
+        for (size_t i = 0; i < size; ++i)
+            grown[i] = std::move(queue.ring[(queue.head + i) % queue.ring.size()]);
+        queue.ring.swap(grown);
+        queue.head = 0;
+    }
+    QueuedTask &slot = queue.ring[(queue.head + size) % queue.ring.size()];
+    slot.task = std::move(task);
+    slot.deadline = deadline;
+    ++queue.size;
+}
+
+bool ThreadPool::popInjected(InjectionQueue &queue, Task &task)
+{
+    while (queue.size.load() > 0)
+    {
+        std::chrono::steady_clock::time_point deadline;
+        {
+            std::lock_guard<std::mutex> lock(queue.mtx);
+            if (queue.size.load() == 0)
+                return false;
+            QueuedTask &slot = queue.ring[queue.head];
+            task = std::move(slot.task);
+            deadline = slot.deadline;
+            queue.head = (queue.head + 1) % queue.ring.size();
+            --queue.size;
+        }
+        if (deadline == std::chrono::steady_clock::time_point() || std::chrono::steady_clock::now() <= deadline)
+            return true;
+        // expired while queued, the task is destroyed outside of the lock
+        task = Task();
+        ++expiredTasks;
+        release();
+    }
+    return false;
+}
+
+bool ThreadPool::steal(Worker *worker, Task &task)
+{
+    size_t n = workers.size();
+    if (n < (worker ? 2u : 1u))
+        return false;
+    // xorshift, start with a random victim and try all of them once
+    size_t start = 0;
+    if (worker)
+    {
+        worker->seed ^= worker->seed << 13;
+        worker->seed ^= worker->seed >> 17;
+        worker->seed ^= worker->seed << 5;
+        start = worker->seed % n;
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        Worker *victim = workers[(start + i) % n].get();
+        if (victim != worker && victim->deque.Steal(task))
+            return true;
+    }
+    return false;
+}
+
+void ThreadPool::wakeWorker()
+{
+    // a spinning worker takes the task and passes the wakeup on
+    if (spinning.load() > 0)
+        return;
+    if (sleepers.load() > 0)
+    {
+        std::lock_guard<std::mutex> lock(park_mtx);
+        cond.notify_one();
+    }
+}
+
+void ThreadPool::wakeWorkers(size_t count)
+{
+    int spinners = spinning.load();
+    count = count > (size_t)spinners ? count - spinners : 0;
+    int sleeping = sleepers.load();
+    if (sleeping > 0 && count > 0)
+    {
+        std::lock_guard<std::mutex> lock(park_mtx);
+        if (count >= (size_t)sleeping)
+        {
+            cond.notify_all();
+            return;
+        }
+        for (size_t i = 0; i < count; ++i)
+            cond.notify_one();
     }
 }
\ No newline at end of file
@@ -1,34 +1,260 @@
 #pragma once
 
 #include<queue>
+#include<vector>
+#include<memory>
 #include<functional>
 #include<mutex>
 #include<condition_variable>
 #include<thread>
 #include<atomic>
+#include<future>
+#include<iterator>
+#include<type_traits>
+#include<chrono>
+#include"WorkStealingDeque.h"
+#include"Task.h"
 
+/// What SubmitTask does when the pool already holds its capacity of queued tasks
+enum class OverflowPolicy
+{
+    /// Waits until a worker takes a task. Submissions from the pool's own workers run in the caller instead
+    Block,
+    /// Drops the submitted task
+    DropNewest,
+    /// Drops the longest waiting task and queues the submitted one
+    DropOldest,
+    /// Runs the submitted task on the submitting thread
+    CallerRuns
+};
+
+/// Scheduling class of a task. Workers take high priority tasks before anything else and low priority ones
+/// only when there is no other work
+enum class TaskPriority
+{
+    High,
+    Normal,
+    Low
+};
+
+/// Work-stealing thread pool. Tasks submitted by workers go to their own deque, other submitters use
+/// the shared injection queue. Idle workers steal from random victims before they go to sleep.
 class ThreadPool {
 public:
     /// Creates the thread pool with provided size.
     ThreadPool(int size);
+
+    /// Creates the thread pool which queues at most capacity tasks (0 means unbounded),
+    /// policy decides what happens with tasks which do not fit.
+    ThreadPool(int size, size_t capacity, OverflowPolicy policy);
+
+    /// Creates elastic thread pool which keeps between minSize and maxSize workers. Workers are added while
+    /// queued tasks wait longer than the growth threshold, and retire after the idle timeout.
+    ThreadPool(int minSize, int maxSize, size_t capacity, OverflowPolicy policy);
     ~ThreadPool();
 
-    /// Submits task to thread pool.
-    void SubmitTask(std::function<void()> task);
+    /// Submits task to thread pool. Any callable converts to Task, small ones without heap allocation.
+    void SubmitTask(Task task);
+
+    /// Submits task with the priority.
+    void SubmitTask(Task task, TaskPriority priority);
+
+    /// Submits task which is dropped instead of run when it is still queued after the deadline.
+    void SubmitTask(Task task, TaskPriority priority, std::chrono::steady_clock::time_point deadline);
+
+    /// Submits task to the lane, see AddLane.
+    void SubmitTask(Task task, TaskPriority priority, std::chrono::steady_clock::time_point deadline, size_t lane);
+
+    /// Adds a lane for normal priority tasks and returns its id. Workers take tasks from the lanes in turns, so that
+    /// several servers sharing the pool get fair service. Lane 0 is the default one, which is also returned when
+    /// all maxLanes are in use. Lanes given back by RemoveLane are handed out again.
+    size_t AddLane();
+
+    /// Gives the lane back once its submitter is done with it. Tasks still queued on it are run.
+    void RemoveLane(size_t lane);
+
+    /// Submits callable and returns the future of its result. The future reports broken_promise
+    /// when the overflow policy drops the task.
+    template <typename F>
+    std::future<typename std::result_of<typename std::decay<F>::type()>::type> Submit(F &&f)
+    {
+        typedef typename std::result_of<typename std::decay<F>::type()>::type R;
+        std::packaged_task<R()> task(std::forward<F>(f));
+        auto future = task.get_future();
+        SubmitTask(std::move(task));
+        return future;
+    }
+
+    /// Submits callable with the priority and an optional deadline. The future reports broken_promise when
+    /// the task expires in the queue.
+    template <typename F>
+    std::future<typename std::result_of<typename std::decay<F>::type()>::type> Submit(F &&f, TaskPriority priority,
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point())
+    {
+        typedef typename std::result_of<typename std::decay<F>::type()>::type R;
+        std::packaged_task<R()> task(std::forward<F>(f));
+        auto future = task.get_future();
+        SubmitTask(std::move(task), priority, deadline);
+        return future;
+    }
+
+    /// Submits all callables in [first, last) to the lane with one queue lock acquisition and one wakeup round.
+    /// Callables are copied, use std::make_move_iterator to move them.
+    template <typename It>
+    void SubmitBatch(It first, It last, size_t lane = 0)
+    {
+        std::vector<Task> tasks;
+        tasks.reserve(std::distance(first, last));
+        for (; first != last; ++first)
+            tasks.emplace_back(*first);
+        SubmitTasks(tasks, lane);
+    }
+
+    /// Submits all tasks to the lane with one queue lock acquisition and one wakeup round.
+    void SubmitTasks(std::vector<Task> &tasks, size_t lane = 0);
 
     /// Shutdown thread pool. When there are some tasks on the task queue these will be completed first.
     void Shutdown();
 
     bool isHalted();
 
+    /// Pins the n-th worker to cpus[n % cpus.size()].
+    void PinWorkers(const std::vector<int> &cpus);
+
+    /// Binds the n-th worker to all allowed cpus of the (n % nodes)-th NUMA node, so that workers
+    /// are spread evenly across nodes and migrate only within their node.
+    void SpreadWorkersAcrossNumaNodes();
+
+    /// Sets how long queued tasks may wait with every worker busy before an elastic pool adds workers.
+    void SetGrowthThreshold(std::chrono::microseconds threshold);
+
+    /// Sets how long a worker of an elastic pool stays idle before it retires.
+    void SetIdleTimeout(std::chrono::milliseconds timeout);
+
+    /// Lets idle workers spin, and then yield, for up to the given time before they park. Submitters skip the
+    /// wakeup while a worker spins, which saves the futex wake and scheduler hop on every handoff. 0 disables spinning.
+    void SetSpinWait(std::chrono::microseconds spin);
+
+    static const size_t maxLanes = 64;
+
+    /// Gets the number of running workers.
+    int GetWorkerCount();
+
+    /// Gets the number of tasks which were dropped because the queue was full.
+    size_t GetDroppedTasks();
+
+    /// Gets the number of tasks which were dropped because their deadline passed while they were queued.
+    size_t GetExpiredTasks();
+
+    /// Gets the number of tasks which ran on the submitting thread because the queue was full.
+    size_t GetCallerRunTasks();
+
 private:
 
-std::vector<std::thread> workers;
-std::queue<std::function<void()>> task_queue;
-std::mutex task_queue_mtx;
+struct Worker
+{
+    WorkStealingDeque<Task> deque;
+    std::thread thread;
+    size_t index;
+    /// State of the random victim selection
+    uint32_t seed;
+    /// Lane to look at first, rotates so that lanes are served in turns
+    size_t nextLane;
+    /// Whether a thread runs this worker, retired slots are reused when the pool grows
+    std::atomic<bool> running;
+    Worker(size_t capacity, size_t index, uint32_t seed) : deque(capacity), index(index), seed(seed), nextLane(0), running(false) {}
+};
+
+/// Task waiting in an injection queue, deadline is zero when there is none
+struct QueuedTask
+{
+    Task task;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+/// Ring buffer which only grows, so that queued tasks do not allocate in steady state
+struct InjectionQueue
+{
+    std::vector<QueuedTask> ring;
+    size_t head;
+    std::mutex mtx;
+    std::atomic<size_t> size;
+    InjectionQueue(size_t capacity) : ring(capacity), head(0), size(0) {}
+};
+
+static const size_t workerQueueCapacity = 1024;
+static const size_t priorityQueueCapacity = 64;
+static const int64_t defaultGrowthThresholdUs = 20000;
+static const int64_t defaultIdleTimeoutMs = 10000;
+
+/// Slots for the maximum number of workers, allocated up front so that thieves iterate a fixed array
+std::vector<std::unique_ptr<Worker>> workers;
+std::mutex resize_mtx;
+int minWorkers;
+std::atomic<int> liveWorkers;
+std::atomic<int64_t> growthThresholdUs;
+std::atomic<int64_t> idleTimeoutMs;
+/// Tasks taken by workers, counted only by elastic pools
+std::atomic<size_t> startedTasks;
+std::thread monitor;
+std::mutex monitor_mtx;
+std::condition_variable monitor_cond;
+/// Queues for high and low priority tasks and one lane per submitter for the normal ones. They hold tasks from
+/// threads which are not workers of this pool, tasks which did not fit into a worker deque, and all tasks which
+/// are not normal priority or have a deadline.
+InjectionQueue highQueue;
+InjectionQueue lowQueue;
+/// Lanes are only added, laneCount is published after the lane is created. A removed lane stays in place and
+/// is drained by the workers until AddLane hands it out again
+std::unique_ptr<InjectionQueue> lanes[maxLanes];
+std::atomic<size_t> laneCount;
+bool laneInUse[maxLanes];
+std::mutex lane_mtx;
+/// Tasks which are submitted but have not been taken by a worker yet
+std::atomic<size_t> pendingTasks;
+std::atomic<int> sleepers;
+/// Idle workers which poll for tasks before they park, at most half of the workers spin at once
+std::atomic<int> spinning;
+std::atomic<int64_t> spinWaitUs;
+std::mutex park_mtx;
 std::condition_variable cond;
 std::atomic<bool> halted;
+size_t capacity;
+OverflowPolicy policy;
+std::atomic<size_t> droppedTasks;
+std::atomic<size_t> callerRunTasks;
+std::atomic<size_t> expiredTasks;
+/// Submitters waiting for space in the queue with the Block policy
+std::atomic<int> blockedSubmitters;
+std::mutex not_full_mtx;
+std::condition_variable not_full;
+/// Cpu sets the workers are bound to, the n-th worker uses set n % size, empty means no binding
+std::vector<std::vector<int>> placement;
+std::mutex placement_mtx;
+
+/// Worker which runs on the current thread, if any
+static thread_local Worker *currentWorker;
+static thread_local ThreadPool *currentPool;
 
-void createThreadPool(int size);
+void createThreadPool(int minSize, int maxSize);
+bool isElastic();
+void grow(size_t count);
+bool retire();
+void runMonitor();
+bool reserve();
+size_t reserve(size_t count);
+void release();
+void runWorker(Worker *worker);
+void setPlacement(std::vector<std::vector<int>> sets);
+bool findTask(Worker *worker, Task &task);
+bool spin(Worker *worker, Task &task);
+InjectionQueue &queueFor(TaskPriority priority, size_t lane);
+bool popLanes(size_t &cursor, Task &task);
+void pushInjected(InjectionQueue &queue, Task &&task, std::chrono::steady_clock::time_point deadline);
+void pushInjectedLocked(InjectionQueue &queue, Task &&task, std::chrono::steady_clock::time_point deadline);
+bool popInjected(InjectionQueue &queue, Task &task);
+bool steal(Worker *worker, Task &task);
+void wakeWorker();
+void wakeWorkers(size_t count);
 
 };
\ No newline at end of file
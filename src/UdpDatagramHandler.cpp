@@ -1,6 +1,15 @@
 #include "UdpDatagramHandler.h"
 #include "UdpServer.h"
 
+UdpDatagramHandler::~UdpDatagramHandler() {}
+
+void UdpDatagramHandler::HandleDatagramView(const uint8_t *data, size_t len, const struct sockaddr_in &from)
+{
+    SetDatagram(std::string((const char *)data, len));
+    SetAddress(std::make_shared<Address>(from));
+    HandleDatagram();
+}
+
 void UdpDatagramHandler::SetSocket(std::shared_ptr<Socket> socket)
 {
     this->socket = socket;
@@ -7,9 +7,15 @@ class UdpServer;
 class UdpDatagramHandler
 {
 public:
+    virtual ~UdpDatagramHandler();
+
     /// Handles incoming datagram
     virtual void HandleDatagram() = 0;
 
+    /// Handles datagram which is received in place, data and address are valid only during the call.
+    /// Default implementation copies them and calls HandleDatagram(), override to avoid the copy
+    virtual void HandleDatagramView(const uint8_t *data, size_t len, const struct sockaddr_in &from);
+
     /// Sets udp client socket
     void SetSocket(std::shared_ptr<Socket> socket);
 
@@ -1,4 +1,7 @@
 #include "UdpServer.h"
+#include "CpuAffinity.h"
+#include <algorithm>
+#include <cstring>
 
 std::shared_ptr<UdpServer> UdpServer::Create(std::function<std::shared_ptr<UdpDatagramHandler>()> datagramHandlerFactory)
 {
@@ -9,12 +12,27 @@ UdpServer::UdpServer(std::function<std::shared_ptr<UdpDatagramHandler>()> datagr
 {
 	listening = false;
 	tpSize = defaultThreadPoolSize;
+	tpMaxSize = defaultThreadPoolSize;
+	executorLane = 0;
+	tpSpinWait = std::chrono::microseconds(0);
+	tpCapacity = 0;
+	tpPolicy = OverflowPolicy::Block;
+	taskDeadline = std::chrono::milliseconds(0);
+	droppedTasks = 0;
+	receiveMode = UdpReceiveMode::Default;
+	batchSize = defaultBatchSize;
+	gro = false;
+	pipelineDispatch = UdpPipelineDispatch::RoundRobin;
+	listenerCount = std::max<int>(std::thread::hardware_concurrency(), 1);
+	tpNumaSpread = false;
 	this->datagramHandlerFactory = datagramHandlerFactory;
 }
 
 UdpServer::~UdpServer()
 {
 	Clean();
+	if (executor)
+		executor->RemoveLane(executorLane);
 }
 
 void UdpServer::Listen(uint16_t port)
@@ -35,19 +53,51 @@ void UdpServer::Listen(std::string ip, uint16_t port)
 
 void UdpServer::_Listen()
 {
-	tp = std::make_shared<ThreadPool>(tpSize);
-	socket = Socket::Create(SOCK_DGRAM);
 	auto address = ip.empty() ? std::make_shared<Address>(port) : std::make_shared<Address>(ip, port);
 	ip = address->GetIP();
+	if (gro && receiveMode == UdpReceiveMode::IoUringMultishot)
+	{
+		// provided buffers are too small for coalesced datagrams
+		throw UdpServerException("GRO is not supported in IoUringMultishot mode");
+	}
+	if (receiveMode == UdpReceiveMode::ReusePort)
+	{
+		ReusePortListen(address);
+		Clean();
+		return;
+	}
+
+	socket = Socket::Create(SOCK_DGRAM);
 	socket->Bind(address);
 
 	listening = true;
 	halted = false;
 
+	if (receiveMode == UdpReceiveMode::Pipeline)
+		PipelineListen();
+	else if (receiveMode != UdpReceiveMode::IoUringMultishot || !MultishotReceiveLoop())
+	{
+		// coalescing already hands over many datagrams per wakeup in Batched mode
+		if (!gro || !GroReceiveLoop())
+		{
+			if (receiveMode == UdpReceiveMode::Batched)
+				BatchReceiveLoop();
+			else
+				ReceiveLoop();
+		}
+	}
+
+	Clean();
+}
+
+void UdpServer::ReceiveLoop()
+{
+	CreateThreadPool();
+
 	while (!halted.load())
 	{
 		std::shared_ptr<Address> client;
-		std::vector<uint8_t> datagram = socket->RecvFrom(client, 1024);
+		std::vector<uint8_t> datagram = socket->RecvFrom(client, maxDatagramSize);
 
 		if (halted.load())
 			break;
@@ -59,17 +109,640 @@ void UdpServer::_Listen()
 		handler->SetAddress(client);
 
 		// handle datagram
-		std::function<void()> task = [handler] {
+		SubmitHandlerTask([handler = std::move(handler)] {
 			handler->HandleDatagram();
-		};
-		tp->SubmitTask(task);
+		});
+	}
+}
+
+void UdpServer::BatchReceiveLoop()
+{
+	CreateThreadPool();
+
+	// the buffers are reused, only the datagrams handed to the handlers are copied
+	DatagramBatch batch(batchSize);
+	while (!halted.load())
+	{
+		size_t n = batch.Receive(*socket);
+
+		if (halted.load())
+			break;
+
+		auto handlers = std::make_shared<std::vector<std::shared_ptr<UdpDatagramHandler>>>();
+		handlers->reserve(n);
+		for (size_t i = 0; i < n; ++i)
+			handlers->push_back(CreateHandler(std::string((const char *)batch.Data(i), batch.Size(i)), std::make_shared<Address>(batch.from[i])));
+		SubmitHandlers(handlers);
+	}
+}
+
+UdpServer::DatagramBatch::DatagramBatch(size_t count) : data(count * maxDatagramSize), from(count), iov(count), msgs(count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		iov[i].iov_base = Data(i);
+		iov[i].iov_len = maxDatagramSize;
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_name = &from[i];
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+size_t UdpServer::DatagramBatch::Receive(Socket &socket)
+{
+	for (auto &msg : msgs)
+		msg.msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	return socket.RecvFromBatch(msgs.data(), msgs.size());
+}
+
+bool UdpServer::GroReceiveLoop()
+{
+	if (!socket->EnableGro())
+		return false;
+
+	CreateThreadPool();
+	std::vector<uint8_t> buffer(Socket::maxCoalescedSize);
+
+	while (!halted.load())
+	{
+		std::shared_ptr<Address> client;
+		size_t segmentSize;
+		size_t n = socket->RecvFromCoalesced(client, buffer.data(), buffer.size(), &segmentSize);
+
+		if (halted.load())
+			break;
+
+		// split coalesced datagrams back, an empty datagram still gets its handler
+		auto handlers = std::make_shared<std::vector<std::shared_ptr<UdpDatagramHandler>>>();
+		size_t offset = 0;
+		do
+		{
+			size_t len = std::min(segmentSize, n - offset);
+			handlers->push_back(CreateHandler(std::string((const char *)buffer.data() + offset, len), client));
+			offset += len;
+		} while (offset < n);
+		SubmitHandlers(handlers);
+	}
+	return true;
+}
+
+void UdpServer::ReusePortListen(std::shared_ptr<Address> address)
+{
+	{
+		std::lock_guard<std::mutex> lock(_sockets);
+		try
+		{
+			for (int i = 0; i < listenerCount; ++i)
+			{
+				auto s = Socket::Create(SOCK_DGRAM);
+				s->EnableReusePort();
+				s->Bind(address);
+				sockets.push_back(s);
+			}
+		}
+		catch (...)
+		{
+			// the sockets bound so far would keep the port and take datagrams nobody reads
+			sockets.clear();
+			throw;
+		}
+	}
+
+	listening = true;
+	halted = false;
+
+	std::exception_ptr error;
+	std::mutex _error;
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < sockets.size(); ++i)
+	{
+		auto s = sockets[i];
+		threads.emplace_back([this, s, i, &error, &_error] {
+			try
+			{
+				ReusePortReceiveLoop(s, i);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(_error);
+				if (!error)
+					error = std::current_exception();
+				// bring the other threads down as well
+				Stop();
+			}
+		});
+	}
+	for (auto &thread : threads)
+		thread.join();
+	if (error)
+	{
+		Clean();
+		std::rethrow_exception(error);
+	}
+}
+
+void UdpServer::ReusePortReceiveLoop(std::shared_ptr<Socket> socket, size_t index)
+{
+	if (!listenerCpus.empty())
+		CpuAffinity::PinCurrentThread(listenerCpus[index % listenerCpus.size()]);
+
+	auto handler = datagramHandlerFactory();
+	handler->SetSocket(socket);
+	handler->SetServer(shared_from_this());
+
+	if (gro && socket->EnableGro())
+	{
+		ReusePortGroReceiveLoop(socket, *handler);
+		return;
+	}
+
+	DatagramBatch batch(batchSize);
+	while (!halted.load())
+	{
+		size_t n = batch.Receive(*socket);
+
+		if (halted.load())
+			break;
+
+		// handle datagrams right on the receiving thread
+		for (size_t i = 0; i < n; ++i)
+		{
+			try
+			{
+				handler->HandleDatagramView(batch.Data(i), batch.Size(i), batch.from[i]);
+			}
+			catch (std::exception &e)
+			{
+			}
+		}
+	}
+}
+
+void UdpServer::ReusePortGroReceiveLoop(std::shared_ptr<Socket> socket, UdpDatagramHandler &handler)
+{
+	std::vector<uint8_t> buffer(Socket::maxCoalescedSize);
+	while (!halted.load())
+	{
+		std::shared_ptr<Address> client;
+		size_t segmentSize;
+		size_t n = socket->RecvFromCoalesced(client, buffer.data(), buffer.size(), &segmentSize);
+
+		if (halted.load())
+			break;
+
+		size_t offset = 0;
+		do
+		{
+			size_t len = std::min(segmentSize, n - offset);
+			try
+			{
+				handler.HandleDatagramView(buffer.data() + offset, len, *client->GetRawAddress());
+			}
+			catch (std::exception &e)
+			{
+			}
+			offset += len;
+		} while (offset < n);
+	}
+}
+
+/// Spreads flows evenly, the same source address and port always map to the same value
+static size_t FlowHash(const struct sockaddr_in &from)
+{
+	uint64_t key = ((uint64_t)from.sin_addr.s_addr << 16) | from.sin_port;
+	return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+void UdpServer::PipelineListen()
+{
+	size_t count = std::max(tpSize, 1);
+	std::vector<std::unique_ptr<PipelineWorker>> workers;
+	for (size_t i = 0; i < count; ++i)
+	{
+		workers.emplace_back(new PipelineWorker(pipelineRingSize));
+		workers[i]->handler = datagramHandlerFactory();
+		workers[i]->handler->SetSocket(socket);
+		workers[i]->handler->SetServer(shared_from_this());
+	}
+	for (size_t i = 0; i < count; ++i)
+	{
+		PipelineWorker *worker = workers[i].get();
+		worker->thread = std::thread([this, worker, i] { PipelineWorkerLoop(*worker, i); });
+	}
+
+	std::exception_ptr error;
+	try
+	{
+		PipelineReceiveLoop(workers);
+	}
+	catch (...)
+	{
+		error = std::current_exception();
+	}
+
+	// workers handle what is left in their rings and leave
+	halted = true;
+	for (auto &worker : workers)
+	{
+		{
+			std::lock_guard<std::mutex> lock(worker->mtx);
+			worker->cond.notify_all();
+		}
+		worker->thread.join();
+	}
+	if (error)
+	{
+		Clean();
+		std::rethrow_exception(error);
+	}
+}
+
+void UdpServer::PipelineReceiveLoop(std::vector<std::unique_ptr<PipelineWorker>> &workers)
+{
+	if (!listenerCpus.empty())
+		CpuAffinity::PinCurrentThread(listenerCpus[0]);
+
+	// datagrams are received in batches, everything is allocated up front. Workers take turns, so the slots
+	// of a batch are claimed in the rings before the receive and the datagrams land right where the workers
+	// read them. With FlowHash the worker is known only once the address is read, those datagrams go through
+	// staging slots and are copied
+	size_t count = workers.size();
+	bool roundRobin = pipelineDispatch == UdpPipelineDispatch::RoundRobin;
+	std::vector<PipelineSlot> staging(roundRobin ? 1 : batchSize);
+	std::vector<PipelineSlot *> claimed(batchSize);
+	std::vector<struct mmsghdr> msgs(batchSize);
+	std::vector<struct iovec> iov(batchSize);
+	std::vector<size_t> claims(count, 0);
+	std::vector<size_t> received(count, 0);
+	std::vector<char> touched(count, 0);
+	for (size_t i = 0; i < batchSize; ++i)
+	{
+		PipelineSlot &slot = staging[roundRobin ? 0 : i];
+		iov[i].iov_base = slot.data;
+		iov[i].iov_len = maxDatagramSize;
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_name = &slot.from;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	size_t next = 0;
+	auto dispatch = [&](const uint8_t *data, size_t len, const struct sockaddr_in &from) {
+		size_t w = roundRobin ? next++ % count : FlowHash(from) % count;
+		PipelineSlot *slot = workers[w]->ring.Claim();
+		if (!slot)
+		{
+			// the worker is behind, the datagram is dropped like the kernel would drop it
+			++droppedTasks;
+			return;
+		}
+		// like recvmmsg truncates datagrams which do not fit into a slot
+		slot->len = len < maxDatagramSize ? len : maxDatagramSize;
+		slot->from = from;
+		memcpy(slot->data, data, slot->len);
+		workers[w]->ring.Publish();
+		touched[w] = 1;
+	};
+
+	// coalesced datagrams are received into one buffer and split across the workers
+	std::vector<uint8_t> coalesced;
+	if (gro && socket->EnableGro())
+		coalesced.resize(Socket::maxCoalescedSize);
+
+	while (!halted.load())
+	{
+		if (!coalesced.empty())
+		{
+			std::shared_ptr<Address> client;
+			size_t segmentSize;
+			size_t n = socket->RecvFromCoalesced(client, coalesced.data(), coalesced.size(), &segmentSize);
+
+			if (halted.load())
+				break;
+
+			size_t offset = 0;
+			do
+			{
+				size_t len = std::min(segmentSize, n - offset);
+				dispatch(coalesced.data() + offset, len, *client->GetRawAddress());
+				offset += len;
+			} while (offset < n);
+		}
+		else if (roundRobin)
+		{
+			// the i-th datagram goes to worker (next + i) % count, into the slot after the ones claimed for the
+			// earlier datagrams of the batch. Datagrams for a worker without room land in the shared staging slot
+			for (size_t i = 0; i < batchSize; ++i)
+			{
+				size_t w = (next + i) % count;
+				claimed[i] = workers[w]->ring.Claim(claims[w]);
+				PipelineSlot *slot = claimed[i] ? claimed[i] : &staging[0];
+				if (claimed[i])
+					++claims[w];
+				iov[i].iov_base = slot->data;
+				msgs[i].msg_hdr.msg_name = &slot->from;
+				msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			}
+			size_t n = socket->RecvFromBatch(msgs.data(), msgs.size());
+
+			if (halted.load())
+				break;
+
+			for (size_t i = 0; i < n; ++i)
+			{
+				size_t w = (next + i) % count;
+				if (!claimed[i])
+				{
+					// the worker is behind, the datagram is dropped like the kernel would drop it
+					++droppedTasks;
+					continue;
+				}
+				claimed[i]->len = msgs[i].msg_len;
+				++received[w];
+			}
+			// slots claimed for datagrams which did not come are claimed again by the next batch
+			for (size_t w = 0; w < count; ++w)
+			{
+				if (received[w] > 0)
+				{
+					workers[w]->ring.Publish(received[w]);
+					touched[w] = 1;
+				}
+				claims[w] = received[w] = 0;
+			}
+			next += n;
+		}
+		else
+		{
+			for (size_t i = 0; i < batchSize; ++i)
+				msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			size_t n = socket->RecvFromBatch(msgs.data(), msgs.size());
+
+			if (halted.load())
+				break;
+
+			for (size_t i = 0; i < n; ++i)
+				dispatch(staging[i].data, msgs[i].msg_len, staging[i].from);
+		}
+
+		// one wakeup per worker and batch
+		for (size_t w = 0; w < count; ++w)
+		{
+			if (touched[w])
+			{
+				WakePipelineWorker(*workers[w]);
+				touched[w] = 0;
+			}
+		}
 	}
-	Clean();
+}
+
+void UdpServer::PipelineWorkerLoop(PipelineWorker &worker, size_t index)
+{
+	if (tpNumaSpread)
+	{
+		auto nodes = CpuAffinity::GetNumaNodes();
+		CpuAffinity::PinCurrentThread(nodes[index % nodes.size()]);
+	}
+	else if (!tpCpus.empty())
+		CpuAffinity::PinCurrentThread(tpCpus[index % tpCpus.size()]);
+
+	for (;;)
+	{
+		PipelineSlot *slot = worker.ring.Front();
+		if (slot)
+		{
+			try
+			{
+				worker.handler->HandleDatagramView(slot->data, slot->len, slot->from);
+			}
+			catch (std::exception &e)
+			{
+			}
+			worker.ring.Pop();
+			continue;
+		}
+		if (halted.load())
+			break;
+
+		// poll for a while before parking, like the thread pool workers do
+		auto deadline = std::chrono::steady_clock::now() + tpSpinWait;
+		while (worker.ring.Empty() && !halted.load() && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::yield();
+		if (!worker.ring.Empty())
+			continue;
+
+		// the receiver publishes before it checks sleeping, the worker sets sleeping before it checks the
+		// ring, so one of them sees the other
+		worker.sleeping.store(true);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		{
+			std::unique_lock<std::mutex> lock(worker.mtx);
+			worker.cond.wait(lock, [this, &worker] { return !worker.ring.Empty() || halted.load(); });
+		}
+		worker.sleeping.store(false);
+	}
+}
+
+void UdpServer::WakePipelineWorker(PipelineWorker &worker)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (worker.sleeping.load())
+	{
+		std::lock_guard<std::mutex> lock(worker.mtx);
+		worker.cond.notify_one();
+	}
+}
+
+std::shared_ptr<UdpDatagramHandler> UdpServer::CreateHandler(std::string datagram, std::shared_ptr<Address> address)
+{
+	auto handler = datagramHandlerFactory();
+	handler->SetSocket(socket);
+	handler->SetDatagram(datagram);
+	handler->SetServer(shared_from_this());
+	handler->SetAddress(address);
+	return handler;
+}
+
+void UdpServer::SubmitHandlers(std::shared_ptr<std::vector<std::shared_ptr<UdpDatagramHandler>>> handlers)
+{
+	// handle all datagrams in one task
+	SubmitHandlerTask([handlers = std::move(handlers)] {
+		for (auto &handler : *handlers)
+		{
+			try
+			{
+				handler->HandleDatagram();
+			}
+			catch (std::exception &e)
+			{
+			}
+		}
+	});
+}
+
+bool UdpServer::MultishotReceiveLoop()
+{
+	if (!IoUring::IsSupported())
+		return false;
+
+	std::unique_ptr<IoUring> ring;
+	try
+	{
+		int fd = socket->GetSocket();
+		ring.reset(new IoUring(ringEntries, ringCqEntries));
+		ring->RegisterFiles(&fd, 1);
+		ring->SetupBufferRing(ringBufferGroup, ringBufferCount, ringBufferSize);
+	}
+	catch (IoUringException &e)
+	{
+		return false;
+	}
+
+	auto handler = datagramHandlerFactory();
+	handler->SetSocket(socket);
+	handler->SetServer(shared_from_this());
+
+	bool armed = false;
+	bool received = false;
+	while (!halted.load())
+	{
+		if (!armed)
+		{
+			ring->PrepareRecvMsgMultishot(0, ringBufferGroup, 0, 0);
+			armed = true;
+		}
+		int ret = ring->Submit(1);
+		if (ret < 0 && ret != -EINTR)
+		{
+			std::string err(strerror(-ret));
+			throw UdpServerException("io_uring_enter error: " + err);
+		}
+
+		IoUringCompletion completion;
+		while (!halted.load() && ring->PopCompletion(&completion))
+		{
+			// the request terminates e.g. when provided buffers run out and has to be rearmed
+			if (!IoUring::HasMore(completion))
+				armed = false;
+
+			IoUringRecvMsg msg;
+			uint16_t bid;
+			if (!ring->ParseRecvMsg(completion, &msg, &bid))
+			{
+				// kernel does not support multishot recvmsg
+				if (completion.res == -EINVAL && !received)
+					return false;
+				continue;
+			}
+			received = true;
+			if (completion.res >= 0 && msg.address)
+			{
+				try
+				{
+					handler->HandleDatagramView(msg.payload, msg.payloadLen, *msg.address);
+				}
+				catch (std::exception &e)
+				{
+				}
+			}
+			ring->RecycleBuffer(bid);
+		}
+	}
+	return true;
 }
 
 void UdpServer::SetThreadPoolSize(int size)
 {
 	tpSize = size;
+	tpMaxSize = size;
+}
+
+void UdpServer::SetThreadPoolSize(int minSize, int maxSize)
+{
+	tpSize = minSize;
+	tpMaxSize = maxSize;
+}
+
+void UdpServer::SetThreadPoolSpinWait(std::chrono::microseconds spin)
+{
+	tpSpinWait = spin;
+}
+
+void UdpServer::SetTaskQueueLimit(size_t capacity, OverflowPolicy policy)
+{
+	tpCapacity = capacity;
+	tpPolicy = policy;
+}
+
+void UdpServer::SetTaskDeadline(std::chrono::milliseconds maxWait)
+{
+	taskDeadline = maxWait;
+}
+
+size_t UdpServer::GetDroppedTasks()
+{
+	// the listener thread creates and resets the pool, the counters of a pool reset meanwhile are in droppedTasks
+	std::lock_guard<std::mutex> lock(_tp);
+	auto pool = tp ? tp : executor;
+	return droppedTasks.load() + (pool ? pool->GetDroppedTasks() + pool->GetExpiredTasks() : 0);
+}
+
+void UdpServer::SetReceiveMode(UdpReceiveMode mode)
+{
+	receiveMode = mode;
+}
+
+void UdpServer::SetBatchSize(size_t size)
+{
+	batchSize = std::max<size_t>(size, 1);
+}
+
+void UdpServer::SetListenerCount(int count)
+{
+	listenerCount = std::max(count, 1);
+}
+
+void UdpServer::SetListenerAffinity(bool pin)
+{
+	listenerCpus = pin ? CpuAffinity::GetAllowedCpus() : std::vector<int>();
+}
+
+void UdpServer::SetListenerCpus(const std::vector<int> &cpus)
+{
+	listenerCpus = cpus;
+}
+
+void UdpServer::SetThreadPoolCpus(const std::vector<int> &cpus)
+{
+	tpCpus = cpus;
+}
+
+void UdpServer::SetThreadPoolNumaSpread(bool spread)
+{
+	tpNumaSpread = spread;
+}
+
+void UdpServer::SetExecutor(std::shared_ptr<ThreadPool> executor)
+{
+	// the lane stays with the server as long as the executor does
+	if (executor == this->executor)
+		return;
+	if (this->executor)
+		this->executor->RemoveLane(executorLane);
+	this->executor = executor;
+	executorLane = executor ? executor->AddLane() : 0;
+}
+
+void UdpServer::SetPipelineDispatch(UdpPipelineDispatch dispatch)
+{
+	pipelineDispatch = dispatch;
+}
+
+void UdpServer::SetGro(bool enabled)
+{
+	gro = enabled;
 }
 
 bool UdpServer::IsListening()
@@ -77,21 +750,73 @@ bool UdpServer::IsListening()
 	return listening.load();
 }
 
+void UdpServer::CreateThreadPool()
+{
+	std::shared_ptr<ThreadPool> pool = executor;
+	if (!pool)
+	{
+		pool = std::make_shared<ThreadPool>(tpSize, tpMaxSize, tpCapacity, tpPolicy);
+		pool->SetSpinWait(tpSpinWait);
+		if (tpNumaSpread)
+			pool->SpreadWorkersAcrossNumaNodes();
+		else if (!tpCpus.empty())
+			pool->PinWorkers(tpCpus);
+	}
+	std::lock_guard<std::mutex> lock(_tp);
+	tp = pool;
+}
+
+void UdpServer::SubmitHandlerTask(Task task)
+{
+	std::chrono::steady_clock::time_point deadline;
+	if (taskDeadline.count() > 0)
+		deadline = std::chrono::steady_clock::now() + taskDeadline;
+	tp->SubmitTask(std::move(task), TaskPriority::Normal, deadline, executorLane);
+}
+
 void UdpServer::Clean()
 {
 	if (socket)
 		socket.reset();
 
+	{
+		std::lock_guard<std::mutex> lock(_sockets);
+		sockets.clear();
+	}
+
 	listening = false;
 
-	if (tp)
-		tp.reset();
+	std::shared_ptr<ThreadPool> pool;
+	{
+		std::lock_guard<std::mutex> lock(_tp);
+		pool.swap(tp);
+		// a shared executor keeps counting, GetDroppedTasks reads it directly
+		if (pool && pool != executor)
+			droppedTasks += pool->GetDroppedTasks() + pool->GetExpiredTasks();
+	}
+	// the own pool waits for its workers outside of the lock
 }
 
 void UdpServer::Stop()
 {
 	halted = true;
 
+	// Shut the per-thread sockets down, which wakes their receive calls
+	{
+		std::lock_guard<std::mutex> lock(_sockets);
+		for (auto &s : sockets)
+		{
+			try
+			{
+				s->Shutdown();
+			}
+			catch (SocketException &e)
+			{
+				// unconnected udp sockets report ENOTCONN but are woken up anyway
+			}
+		}
+	}
+
 	// Send datagram to this server to unblock recvfrom syscall
 	auto s = Socket::Create(SOCK_DGRAM);
 	s->SendTo(std::make_shared<Address>(this->ip, this->port), "Stop");
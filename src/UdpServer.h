@@ -2,9 +2,42 @@
 
 #include <thread>
 #include <functional>
+#include <exception>
+#include <condition_variable>
 #include "Socket.h"
 #include "ThreadPool.h"
 #include "UdpDatagramHandler.h"
+#include "IoUring.h"
+#include "SpscRing.h"
+
+/// Receive path of the udp server
+enum class UdpReceiveMode
+{
+	/// One recvfrom per datagram, every datagram is handled by a new handler in the thread pool
+	Default,
+	/// io_uring multishot recvmsg into kernel provided buffers. Datagrams are handled in place on the
+	/// receiving thread by a single handler through HandleDatagramView, without heap allocations.
+	/// Falls back to Default when the kernel does not support it
+	IoUringMultishot,
+	/// Up to batch size datagrams are received per wakeup (recvmmsg) and handled together by one thread pool task
+	Batched,
+	/// Each listener thread owns its own SO_REUSEPORT socket and handles datagrams run-to-completion through
+	/// HandleDatagramView of its single handler, without the thread pool. The kernel spreads flows across sockets
+	ReusePort,
+	/// The receiving thread hands datagrams over lock-free bounded rings to dedicated worker threads (as many as
+	/// the thread pool size), each handling them through HandleDatagramView of its single handler. Nothing is locked
+	/// or allocated per datagram. Datagrams which do not fit into the ring of their worker are dropped
+	Pipeline
+};
+
+/// How the receiving thread picks the worker for a datagram in Pipeline mode
+enum class UdpPipelineDispatch
+{
+	/// Workers take turns
+	RoundRobin,
+	/// Hash of the source address and port, datagrams of one client are handled in order by one worker
+	FlowHash
+};
 
 class UdpServer : public std::enable_shared_from_this<UdpServer>
 {
@@ -26,14 +59,134 @@ public:
 	/// Sets number of threads in the pool which are used for handling incoming datagrams
 	void SetThreadPoolSize(int size);
 
+	/// Sets elastic thread pool size, workers are added while tasks wait with every worker busy
+	/// and retire after being idle for a while
+	void SetThreadPoolSize(int minSize, int maxSize);
+
+	/// Lets idle thread pool workers spin for up to the given time before they park, which cuts the
+	/// handoff latency of tasks at the cost of cpu time. 0 disables spinning
+	void SetThreadPoolSpinWait(std::chrono::microseconds spin);
+
+	/// Limits the number of datagram tasks waiting in the thread pool, policy decides what happens with the
+	/// ones which do not fit. 0 means unbounded
+	void SetTaskQueueLimit(size_t capacity, OverflowPolicy policy);
+
+	/// Drops datagrams whose handler task waited in the thread pool queue longer than maxWait,
+	/// stale requests are not worth answering under overload. 0 means no limit
+	void SetTaskDeadline(std::chrono::milliseconds maxWait);
+
+	/// Gets the number of datagram tasks which were dropped because the thread pool queue was full
+	/// or their deadline passed. With a shared executor the counts of the whole pool are included
+	size_t GetDroppedTasks();
+
+	/// Sets the receive path used from the next Listen
+	void SetReceiveMode(UdpReceiveMode mode);
+
+	/// Sets maximum number of datagrams received per wakeup in Batched mode
+	void SetBatchSize(size_t size);
+
+	/// Sets the number of sockets (and threads) in ReusePort mode
+	void SetListenerCount(int count);
+
+	/// Pins the thread of the n-th socket in ReusePort mode to the n-th cpu the process may run on
+	void SetListenerAffinity(bool pin);
+
+	/// Pins the receiving thread (the n-th one in ReusePort mode) to cpus[n % cpus.size()],
+	/// separately from the thread pool workers
+	void SetListenerCpus(const std::vector<int> &cpus);
+
+	/// Pins the n-th thread pool worker to cpus[n % cpus.size()]
+	void SetThreadPoolCpus(const std::vector<int> &cpus);
+
+	/// Spreads thread pool workers evenly across NUMA nodes
+	void SetThreadPoolNumaSpread(bool spread);
+
+	/// Handles datagrams on the given pool instead of creating one, so that several servers share one right-sized
+	/// pool. The server gets its own lane in the pool, lanes are served in turns. The thread pool settings of
+	/// the server do not apply, and stopping the server does not wait for its running tasks. nullptr restores
+	/// the own pool
+	void SetExecutor(std::shared_ptr<ThreadPool> executor);
+
+	/// Sets how datagrams are spread across workers in Pipeline mode
+	void SetPipelineDispatch(UdpPipelineDispatch dispatch);
+
+	/// Enables UDP GRO from the next Listen. Coalesced datagrams are split before they reach the handlers.
+	/// In Default and Batched mode one buffer is handled by one thread pool task, in ReusePort and Pipeline
+	/// mode the datagrams go the same way as without GRO. Listen throws in IoUringMultishot mode, whose
+	/// provided buffers can't take coalesced datagrams
+	void SetGro(bool enabled);
+
 	void Stop();
 
 private:
 	static const int defaultThreadPoolSize = 20;
+	static const size_t defaultBatchSize = 64;
+	static const size_t maxDatagramSize = 1024;
+	static const unsigned ringEntries = 8;
+	static const unsigned ringCqEntries = 4096;
+	static const uint16_t ringBufferGroup = 0;
+	static const unsigned ringBufferCount = 512;
+	static const size_t ringBufferSize = 4096;
+	static const size_t pipelineRingSize = 256;
+
+	/// Datagram in the ring of a pipeline worker
+	struct PipelineSlot
+	{
+		size_t len;
+		struct sockaddr_in from;
+		uint8_t data[maxDatagramSize];
+	};
+
+	/// Buffers of one recvmmsg call, set up once per receive loop
+	struct DatagramBatch
+	{
+		std::vector<uint8_t> data;
+		std::vector<struct sockaddr_in> from;
+		std::vector<struct iovec> iov;
+		std::vector<struct mmsghdr> msgs;
+		DatagramBatch(size_t count);
+		size_t Receive(Socket &socket);
+		uint8_t *Data(size_t i) { return data.data() + i * maxDatagramSize; }
+		size_t Size(size_t i) const { return msgs[i].msg_len; }
+	};
+
+	struct PipelineWorker
+	{
+		SpscRing<PipelineSlot> ring;
+		/// Set before the worker parks, the receiver takes the mutex only to wake a parked worker
+		std::atomic<bool> sleeping;
+		std::mutex mtx;
+		std::condition_variable cond;
+		std::thread thread;
+		std::shared_ptr<UdpDatagramHandler> handler;
+		PipelineWorker(size_t capacity) : ring(capacity), sleeping(false) {}
+	};
+
+	/// Written by the listener thread only, _tp guards it for the readers on other threads
 	std::shared_ptr<ThreadPool> tp;
+	std::mutex _tp;
+	std::shared_ptr<ThreadPool> executor;
+	size_t executorLane;
 	std::shared_ptr<Socket> socket;
+	std::vector<std::shared_ptr<Socket>> sockets;
+	std::mutex _sockets;
+	int listenerCount;
+	/// The n-th listener thread is pinned to listenerCpus[n % size], empty means no pinning
+	std::vector<int> listenerCpus;
+	std::vector<int> tpCpus;
+	bool tpNumaSpread;
 	std::function<std::shared_ptr<UdpDatagramHandler>()> datagramHandlerFactory;
 	int tpSize;
+	int tpMaxSize;
+	std::chrono::microseconds tpSpinWait;
+	size_t tpCapacity;
+	OverflowPolicy tpPolicy;
+	std::chrono::milliseconds taskDeadline;
+	std::atomic<size_t> droppedTasks;
+	UdpReceiveMode receiveMode;
+	size_t batchSize;
+	bool gro;
+	UdpPipelineDispatch pipelineDispatch;
 	uint16_t port;
 	std::string ip;
 	std::atomic<bool> halted;
@@ -41,6 +194,36 @@ private:
 
 	void _Listen();
 
+	void ReceiveLoop();
+
+	bool MultishotReceiveLoop();
+
+	void BatchReceiveLoop();
+
+	bool GroReceiveLoop();
+
+	void ReusePortListen(std::shared_ptr<Address> address);
+
+	void ReusePortReceiveLoop(std::shared_ptr<Socket> socket, size_t index);
+
+	void ReusePortGroReceiveLoop(std::shared_ptr<Socket> socket, UdpDatagramHandler &handler);
+
+	void PipelineListen();
+
+	void PipelineReceiveLoop(std::vector<std::unique_ptr<PipelineWorker>> &workers);
+
+	void PipelineWorkerLoop(PipelineWorker &worker, size_t index);
+
+	void WakePipelineWorker(PipelineWorker &worker);
+
+	std::shared_ptr<UdpDatagramHandler> CreateHandler(std::string datagram, std::shared_ptr<Address> address);
+
+	void SubmitHandlers(std::shared_ptr<std::vector<std::shared_ptr<UdpDatagramHandler>>> handlers);
+
+	void CreateThreadPool();
+
+	void SubmitHandlerTask(Task task);
+
 	void Clean();
 
 	UdpServer(std::function<std::shared_ptr<UdpDatagramHandler>()> datagramHandlerFactory);
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+/// Bounded Chase-Lev deque. The owner thread pushes and pops at the bottom while other threads steal from the top.
+/// Every slot carries a flag so that the owner reuses a slot only after the thief which claimed it has moved the element out
+template <typename T>
+class WorkStealingDeque
+{
+public:
+	/// Creates deque, capacity is rounded up to a power of two
+	explicit WorkStealingDeque(size_t capacity);
+
+	/// Pushes element at the bottom, returns false and leaves item untouched when the deque is full. Owner only
+	bool Push(T &&item);
+
+	/// Pops the most recently pushed element. Owner only
+	bool Pop(T &item);
+
+	/// Steals the least recently pushed element, may be called by any thread
+	bool Steal(T &item);
+
+	/// Gets approximate number of elements
+	size_t Size() const;
+
+private:
+	struct Slot
+	{
+		std::atomic<bool> full;
+		T item;
+		Slot() : full(false) {}
+	};
+
+	std::vector<Slot> slots;
+	size_t mask;
+	/// top and bottom live on their own cache lines, thieves write the first one and the owner the second one
+	char pad0[64];
+	std::atomic<int64_t> top;
+	char pad1[64];
+	std::atomic<int64_t> bottom;
+	char pad2[64];
+};
+
+template <typename T>
+WorkStealingDeque<T>::WorkStealingDeque(size_t capacity) : top(0), bottom(0)
+{
+	size_t size = 1;
+	while (size < capacity)
+		size <<= 1;
+	slots = std::vector<Slot>(size);
+	mask = size - 1;
+}
+
+template <typename T>
+bool WorkStealingDeque<T>::Push(T &&item)
+{
+	int64_t b = bottom.load(std::memory_order_relaxed);
+	int64_t t = top.load(std::memory_order_acquire);
+	Slot &slot = slots[b & mask];
+	if (b - t > (int64_t)mask || slot.full.load(std::memory_order_acquire))
+		return false;
+	slot.item = std::move(item);
+	slot.full.store(true, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	bottom.store(b + 1, std::memory_order_relaxed);
+	return true;
+}
+
+template <typename T>
+bool WorkStealingDeque<T>::Pop(T &item)
+{
+	int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+	bottom.store(b, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t t = top.load(std::memory_order_relaxed);
+	if (t > b)
+	{
+		// empty
+		bottom.store(b + 1, std::memory_order_relaxed);
+		return false;
+	}
+	if (t == b)
+	{
+		// the last element, race against thieves
+		bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+		bottom.store(b + 1, std::memory_order_relaxed);
+		if (!won)
+			return false;
+	}
+	Slot &slot = slots[b & mask];
+	item = std::move(slot.item);
+	slot.item = T();
+	slot.full.store(false, std::memory_order_relaxed);
+	return true;
+}
+
+template <typename T>
+bool WorkStealingDeque<T>::Steal(T &item)
+{
+	int64_t t = top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t b = bottom.load(std::memory_order_acquire);
+	if (t >= b)
+		return false;
+	// claim the slot first, the element is moved out afterwards
+	if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		return false;
+	Slot &slot = slots[t & mask];
+	item = std::move(slot.item);
+	slot.item = T();
+	slot.full.store(false, std::memory_order_release);
+	return true;
+}
+
+template <typename T>
+size_t WorkStealingDeque<T>::Size() const
+{
+	int64_t b = bottom.load(std::memory_order_relaxed);
+	int64_t t = top.load(std::memory_order_relaxed);
+	return b > t ? b - t : 0;
+}
\ No newline at end of file
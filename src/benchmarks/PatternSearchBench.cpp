@@ -0,0 +1,45 @@
+#include "../socknano.h"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+
+typedef std::function<ssize_t(const uint8_t *, size_t, const uint8_t *, size_t)> Kernel;
+
+static double MeasureNs(Kernel kernel, const std::vector<uint8_t> &buf, const std::string &pattern)
+{
+    const size_t bytesPerRun = 256 * 1024 * 1024;
+    size_t iterations = std::max<size_t>(1, bytesPerRun / buf.size());
+    volatile ssize_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        sink = sink + kernel(buf.data(), buf.size(), (const uint8_t *)pattern.data(), pattern.size());
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+int main()
+{
+    std::vector<std::string> patterns = {"\n", "\r\n\r\n"};
+    printf("AVX2 %s, SSE2 %s\n", PatternSearch::HasAvx2() ? "yes" : "no", PatternSearch::HasSse2() ? "yes" : "no");
+    printf("%-10s %8s %12s %12s %12s %10s\n", "pattern", "line", "scalar ns", "sse2 ns", "avx2 ns", "speedup");
+    for (auto &pattern : patterns)
+    {
+        for (size_t len = 16; len <= 64 * 1024; len *= 4)
+        {
+            // a line of text terminated by the delimiter, '\r' makes the multi-byte filter work
+            std::vector<uint8_t> buf(len);
+            for (size_t i = 0; i < len; ++i)
+                buf[i] = (i % 61 == 60) ? '\r' : 'a' + i % 26;
+            std::copy(pattern.begin(), pattern.end(), buf.end() - pattern.size());
+
+            double scalar = MeasureNs(PatternSearch::FindScalar, buf, pattern);
+            double sse2 = MeasureNs(PatternSearch::FindSse2, buf, pattern);
+            double avx2 = MeasureNs(PatternSearch::FindAvx2, buf, pattern);
+            printf("%-10s %8zu %12.1f %12.1f %12.1f %9.1fx\n", pattern == "\n" ? "\\n" : "\\r\\n\\r\\n",
+                   len, scalar, sse2, avx2, scalar / std::min(sse2, avx2));
+        }
+    }
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,130 @@
+#include "../socknano.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include <algorithm>
+
+static std::atomic<size_t> allocations(0);
+
+void *operator new(size_t size)
+{
+    ++allocations;
+    void *p = std::malloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+struct Result
+{
+    double tasksPerSec;
+    double allocationsPerTask;
+};
+
+/// Submits tasks capturing what the servers capture for a handler: a shared_ptr plus some state
+static Result Measure(int workers, size_t tasks, bool nested)
+{
+    ThreadPool tp(workers);
+    auto handler = std::make_shared<int>(1);
+    std::atomic<size_t> done(0);
+    std::atomic<size_t> sink(0);
+
+    size_t before = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    if (nested)
+    {
+        // a few seed tasks fan out from the workers
+        size_t seeds = workers * 4;
+        size_t perSeed = tasks / seeds;
+        for (size_t s = 0; s < seeds; ++s)
+        {
+            tp.SubmitTask([&tp, &done, &sink, handler, perSeed] {
+                for (size_t i = 0; i < perSeed; ++i)
+                {
+                    tp.SubmitTask([&done, &sink, handler, i] {
+                        sink += *handler + i;
+                        ++done;
+                    });
+                }
+            });
+        }
+        tasks = seeds * perSeed;
+    }
+    else
+    {
+        for (size_t i = 0; i < tasks; ++i)
+        {
+            tp.SubmitTask([&done, &sink, handler, i] {
+                sink += *handler + i;
+                ++done;
+            });
+        }
+    }
+    while (done.load() < tasks)
+        std::this_thread::yield();
+    auto end = std::chrono::steady_clock::now();
+    size_t allocated = allocations.load() - before;
+    tp.Shutdown();
+
+    Result result;
+    result.tasksPerSec = tasks / std::chrono::duration<double>(end - start).count();
+    result.allocationsPerTask = (double)allocated / tasks;
+    return result;
+}
+
+/// Median time from submitting a task on an external thread until a worker runs it
+static double MedianHandoffNs(int workers, std::chrono::microseconds spin)
+{
+    ThreadPool tp(workers);
+    tp.SetSpinWait(spin);
+    std::vector<double> samples;
+    for (int i = 0; i < 20000; ++i)
+    {
+        std::atomic<int64_t> ran(0);
+        auto start = std::chrono::steady_clock::now();
+        tp.SubmitTask([&ran] { ran = std::chrono::steady_clock::now().time_since_epoch().count(); });
+        while (ran.load() == 0)
+            std::this_thread::yield();
+        samples.push_back((double)(ran.load() - start.time_since_epoch().count()));
+    }
+    tp.Shutdown();
+    std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+    return samples[samples.size() / 2] * 1e9 * std::chrono::steady_clock::period::num / std::chrono::steady_clock::period::den;
+}
+
+int main()
+{
+    const size_t tasks = 2000000;
+    printf("%8s %10s %14s %12s\n", "workers", "submitter", "tasks/s", "allocs/task");
+    for (int workers : {1, 4, 16})
+    {
+        for (bool nested : {false, true})
+        {
+            Result r = Measure(workers, tasks, nested);
+            printf("%8d %10s %14.0f %12.2f\n", workers, nested ? "workers" : "external", r.tasksPerSec, r.allocationsPerTask);
+        }
+    }
+
+    printf("\n%8s %10s %14s\n", "workers", "spin us", "handoff ns");
+    for (int workers : {1, 4})
+    {
+        for (int spin : {0, 50})
+        {
+            double ns = MedianHandoffNs(workers, std::chrono::microseconds(spin));
+            printf("%8d %10d %14.0f\n", workers, spin, ns);
+        }
+    }
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,65 @@
+#include "../socknano.h"
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+static const size_t bytesPerRun = 1024 * 1024 * 1024;
+
+static void Connect(std::shared_ptr<Socket> &sender, std::shared_ptr<Socket> &receiver)
+{
+    auto servSocket = Socket::Create(SOCK_STREAM);
+    uint16_t port = 20000 + rand() % 20000;
+    servSocket->Bind(std::make_shared<Address>(port));
+    servSocket->Listen(1);
+    receiver = Socket::Create(SOCK_STREAM);
+    receiver->Connect(std::make_shared<Address>(port));
+    sender = servSocket->Accept();
+}
+
+static double MeasureMBps(size_t payloadSize, bool zeroCopy)
+{
+    std::shared_ptr<Socket> sender, receiver;
+    Connect(sender, receiver);
+    if (zeroCopy && !sender->EnableZeroCopy())
+        return 0;
+
+    size_t iterations = bytesPerRun / payloadSize;
+    std::thread drain([receiver, payloadSize, iterations] {
+        std::vector<uint8_t> buf(payloadSize);
+        for (size_t i = 0; i < iterations; ++i)
+            receiver->RecvAll(buf.data(), buf.size());
+    });
+
+    auto payload = std::make_shared<const std::vector<uint8_t>>(payloadSize, 'x');
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        if (zeroCopy)
+            sender->SendAllZeroCopy(payload);
+        else
+            sender->SendAll(*payload);
+    }
+    if (zeroCopy)
+        sender->ReapZeroCopyCompletions(true);
+    drain.join();
+    auto end = std::chrono::steady_clock::now();
+    return iterations * payloadSize / std::chrono::duration<double>(end - start).count() / (1024 * 1024);
+}
+
+int main()
+{
+    // loopback delivers zero copy skbs by copying them on the receive side, so gains are smaller than on a NIC
+    printf("%10s %14s %14s %10s\n", "payload", "SendAll MB/s", "zerocopy MB/s", "speedup");
+    for (size_t size = 16 * 1024; size <= 4 * 1024 * 1024; size *= 4)
+    {
+        double copy = MeasureMBps(size, false);
+        double zeroCopy = MeasureMBps(size, true);
+        if (zeroCopy == 0)
+        {
+            printf("SO_ZEROCOPY is not supported\n");
+            return 0;
+        }
+        printf("%10zu %14.0f %14.0f %9.2fx\n", size, copy, zeroCopy, zeroCopy / copy);
+    }
+    return 0;
+}
\ No newline at end of file
@@ -6,7 +6,16 @@
 #include "TcpServer.h"
 #include "UdpServer.h"
 #include "TcpConnectionHandler.h"
+#include "TcpEventHandler.h"
 #include "UdpServer.h"
 #include "UdpDatagramHandler.h"
 #include "ThreadPool.h"
+#include "Task.h"
+#include "WorkStealingDeque.h"
+#include "SpscRing.h"
+#include "IoUring.h"
+#include "PatternSearch.h"
+#include "CpuAffinity.h"
+#include "ClientRegistry.h"
+#include "BroadcastEngine.h"
 #include "NanoException.h"
\ No newline at end of file
@@ -0,0 +1,47 @@
+#include "catch.hpp"
+#include "../socknano.h"
+#include <algorithm>
+#include <random>
+
+static ssize_t Reference(const std::vector<uint8_t> &buf, const std::string &pattern)
+{
+    auto it = std::search(buf.begin(), buf.end(), pattern.begin(), pattern.end());
+    return it == buf.end() ? -1 : it - buf.begin();
+}
+
+TEST_CASE("all kernels should find the same position", "[pattern-search]")
+{
+    std::mt19937 rng(42);
+    std::vector<std::string> patterns = {"\n", "\r\n", "\r\n\r\n", "AAB", "boundary"};
+
+    for (auto &pattern : patterns)
+    {
+        for (size_t len = 0; len < 300; ++len)
+        {
+            // small alphabet makes partial matches frequent
+            std::vector<uint8_t> buf(len);
+            std::string alphabet = "AB\r\n" + pattern;
+            for (auto &c : buf)
+                c = alphabet[rng() % alphabet.size()];
+
+            ssize_t expected = Reference(buf, pattern);
+            const uint8_t *p = (const uint8_t *)pattern.data();
+            REQUIRE(PatternSearch::FindScalar(buf.data(), len, p, pattern.size()) == expected);
+            REQUIRE(PatternSearch::FindSse2(buf.data(), len, p, pattern.size()) == expected);
+            REQUIRE(PatternSearch::FindAvx2(buf.data(), len, p, pattern.size()) == expected);
+            REQUIRE(PatternSearch::Find(buf.data(), len, p, pattern.size()) == expected);
+        }
+    }
+}
+
+TEST_CASE("should find pattern at the very end of the buffer", "[pattern-search]")
+{
+    std::string pattern = "\r\n\r\n";
+    for (size_t len = pattern.size(); len < 200; ++len)
+    {
+        std::vector<uint8_t> buf(len, 'x');
+        std::copy(pattern.begin(), pattern.end(), buf.end() - pattern.size());
+        REQUIRE(PatternSearch::Find(buf.data(), len, (const uint8_t *)pattern.data(), pattern.size()) == (ssize_t)(len - pattern.size()));
+    }
+    REQUIRE(PatternSearch::Find((const uint8_t *)"abc", 3, (const uint8_t *)"", 0) == -1);
+}
\ No newline at end of file
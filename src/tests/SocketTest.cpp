@@ -224,4 +224,492 @@ TEST_CASE("should send and recv datagram", "[socket]")
     auto datagram = socket->RecvFrom(address, 4);
     std::string datagramStr = std::string(datagram.begin(), datagram.end());
     REQUIRE(datagramStr == "PONG");
+}
+
+TEST_CASE("should transfer data using io_uring backend", "[socket]")
+{
+    uint16_t port = RandomPort();
+    std::thread tcpServer([port] {
+        try
+        {
+            auto servSocket = Socket::Create(SOCK_STREAM);
+            servSocket->SetIoBackend(IoBackend::IoUring);
+            servSocket->Bind(std::make_shared<Address>(port));
+            servSocket->Listen(20);
+            auto socket = servSocket->Accept();
+            REQUIRE(socket->GetIoBackend() == servSocket->GetIoBackend());
+            auto data = socket->RecvUntilString("\n", 128);
+            socket->SendAll(data);
+        }
+        catch (std::exception &e)
+        {
+            FAIL_CHECK(std::string(e.what()));
+        }
+    });
+    tcpServer.detach();
+
+    // wait for server
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    auto socket = Socket::Create(SOCK_STREAM);
+    socket->SetIoBackend(IoBackend::IoUring);
+    REQUIRE(socket->GetIoBackend() == (IoUring::IsSupported() ? IoBackend::IoUring : IoBackend::Default));
+    socket->EnableTimeout(2);
+    socket->Connect(std::make_shared<Address>(port));
+    socket->SendAll("HELLO\n");
+
+    REQUIRE(socket->RecvAllString(6) == "HELLO\n");
+
+    try
+    {
+        socket->RecvAll(1);
+        FAIL_CHECK("Expected SocketConnectionClosedException");
+    }
+    catch (SocketConnectionClosedException &e)
+    {
+        REQUIRE(std::string(e.what()) == "Connection has been closed");
+    }
+}
+
+TEST_CASE("should throw timeout exception using io_uring backend", "[socket]")
+{
+    auto servSocket = Socket::Create(SOCK_STREAM);
+    uint16_t port = RandomPort();
+    servSocket->Bind(std::make_shared<Address>(port));
+    servSocket->Listen(20);
+
+    auto socket = Socket::Create(SOCK_STREAM);
+    socket->SetIoBackend(IoBackend::IoUring);
+    socket->EnableTimeout(1);
+    socket->Connect(std::make_shared<Address>(port));
+    auto peer = servSocket->Accept();
+
+    try
+    {
+        socket->RecvAll(32);
+        FAIL_CHECK("Expected TimeoutException");
+    }
+    catch (TimeoutException &e)
+    {
+        REQUIRE(std::string(e.what()) == "Waiting time has been exceeded");
+    }
+}
+
+TEST_CASE("should close io_uring socket while another thread receives", "[socket]")
+{
+    auto servSocket = Socket::Create(SOCK_STREAM);
+    uint16_t port = RandomPort();
+    servSocket->Bind(std::make_shared<Address>(port));
+    servSocket->Listen(20);
+
+    // many sockets share the ring of this thread
+    std::vector<std::shared_ptr<Socket>> sockets;
+    std::vector<std::shared_ptr<Socket>> peers;
+    for (int i = 0; i < 8; ++i)
+    {
+        auto socket = Socket::Create(SOCK_STREAM);
+        socket->SetIoBackend(IoBackend::IoUring);
+        socket->Connect(std::make_shared<Address>(port));
+        sockets.push_back(socket);
+        peers.push_back(servSocket->Accept());
+    }
+    for (size_t i = 0; i < sockets.size(); ++i)
+    {
+        sockets[i]->SendAll("PING");
+        REQUIRE(peers[i]->RecvAllString(4) == "PING");
+    }
+
+    std::atomic<bool> closed(false);
+    auto socket = sockets[0];
+    std::thread receiver([socket, &closed] {
+        try
+        {
+            socket->RecvAll(1);
+        }
+        catch (SocketException &e)
+        {
+            closed = true;
+        }
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    socket->Shutdown();
+    socket->Close();
+    receiver.join();
+    REQUIRE(closed.load());
+
+    // the ring of the thread keeps serving the other sockets
+    sockets[1]->SendAll("PONG");
+    REQUIRE(peers[1]->RecvAllString(4) == "PONG");
+}
+
+TEST_CASE("should report would block in non-blocking mode", "[socket]")
+{
+    auto servSocket = Socket::Create(SOCK_STREAM);
+    uint16_t port = RandomPort();
+    servSocket->Bind(std::make_shared<Address>(port));
+    servSocket->Listen(20);
+
+    auto socket = Socket::Create(SOCK_STREAM);
+    socket->Connect(std::make_shared<Address>(port));
+    socket->SetNonBlocking(true);
+    REQUIRE(socket->IsNonBlocking());
+
+    auto peer = servSocket->Accept();
+    REQUIRE(!peer->IsNonBlocking());
+
+    uint8_t buf[64];
+    REQUIRE(socket->TryRecv(buf, sizeof(buf)) == 0);
+
+    peer->SendAll("HELLO");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(socket->TryRecv(buf, sizeof(buf)) == 5);
+    REQUIRE(std::string(buf, buf + 5) == "HELLO");
+
+    // fill the send buffer until it would block
+    std::vector<uint8_t> chunk(64 * 1024, 'A');
+    size_t sent = 0;
+    size_t n;
+    while ((n = socket->TrySend(chunk.data(), chunk.size())) > 0)
+    {
+        sent += n;
+    }
+    REQUIRE(sent > 0);
+
+    // blocking calls still complete once the peer drains the data
+    std::thread reader([peer, sent] {
+        peer->RecvAll(sent + 5);
+    });
+    socket->SendAll("WORLD");
+    reader.join();
+
+    peer->Close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    try
+    {
+        socket->TryRecv(buf, sizeof(buf));
+        FAIL_CHECK("Expected SocketConnectionClosedException");
+    }
+    catch (SocketConnectionClosedException &e)
+    {
+        REQUIRE(std::string(e.what()) == "Connection has been closed");
+    }
+}
+
+TEST_CASE("recv until should keep data following the pattern", "[socket]")
+{
+    auto servSocket = Socket::Create(SOCK_STREAM);
+    uint16_t port = RandomPort();
+    servSocket->Bind(std::make_shared<Address>(port));
+    servSocket->Listen(20);
+
+    auto socket = Socket::Create(SOCK_STREAM);
+    socket->EnableTimeout(2);
+    socket->Connect(std::make_shared<Address>(port));
+    auto peer = servSocket->Accept();
+
+    peer->SendAll("first\r\nsecond\r\nAAAABtail");
+
+    REQUIRE(socket->RecvUntilString("\r\n", 128) == "first\r\n");
+    REQUIRE(socket->RecvUntilString("\r\n", 128) == "second\r\n");
+    // pattern preceded by its own partial match
+    REQUIRE(socket->RecvUntilString("AAB", 128) == "AAAAB");
+    REQUIRE(socket->RecvAllString(4) == "tail");
+
+    // pattern split between two segments
+    peer->SendAll("long line ending with \r");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    peer->SendAll("\n");
+    REQUIRE(socket->RecvUntilString("\r\n", 128) == "long line ending with \r\n");
+}
+
+TEST_CASE("should send and recv scattered buffers", "[socket]")
+{
+    auto servSocket = Socket::Create(SOCK_STREAM);
+    uint16_t port = RandomPort();
+    servSocket->Bind(std::make_shared<Address>(port));
+    servSocket->Listen(20);
+
+    auto socket = Socket::Create(SOCK_STREAM);
+    socket->EnableTimeout(2);
+    socket->Connect(std::make_shared<Address>(port));
+    auto peer = servSocket->Accept();
+
+    std::string header = "HEADER";
+    std::vector<uint8_t> payload(1024 * 1024);
+    for (size_t i = 0; i < payload.size(); ++i)
+        payload[i] = i % 251;
+    std::vector<struct iovec> out(100);
+    out[0].iov_base = (void *)header.data();
+    out[0].iov_len = header.size();
+    out[1].iov_base = nullptr;
+    out[1].iov_len = 0;
+    // more buffers than fit into a single sendmsg window
+    size_t chunk = payload.size() / (out.size() - 2);
+    for (size_t i = 2; i < out.size(); ++i)
+    {
+        out[i].iov_base = payload.data() + (i - 2) * chunk;
+        out[i].iov_len = i + 1 < out.size() ? chunk : payload.size() - (i - 2) * chunk;
+    }
+
+    std::thread sender([peer, &out] {
+        peer->SendAllV(out.data(), out.size());
+    });
+
+    std::vector<uint8_t> receivedHeader(header.size());
+    std::vector<uint8_t> receivedPayload(payload.size());
+    struct iovec in[2];
+    in[0].iov_base = receivedHeader.data();
+    in[0].iov_len = receivedHeader.size();
+    in[1].iov_base = receivedPayload.data();
+    in[1].iov_len = receivedPayload.size();
+    socket->RecvAllV(in, 2);
+    sender.join();
+
+    REQUIRE(std::string(receivedHeader.begin(), receivedHeader.end()) == header);
+    REQUIRE(receivedPayload == payload);
+}
+
+TEST_CASE("should send file", "[socket]")
+{
+    auto servSocket = Socket::Create(SOCK_STREAM);
+    uint16_t port = RandomPort();
+    servSocket->Bind(std::make_shared<Address>(port));
+    servSocket->Listen(20);
+
+    auto socket = Socket::Create(SOCK_STREAM);
+    socket->EnableTimeout(2);
+    socket->Connect(std::make_shared<Address>(port));
+    auto peer = servSocket->Accept();
+
+    std::vector<uint8_t> content(3 * 1024 * 1024);
+    for (size_t i = 0; i < content.size(); ++i)
+        content[i] = i % 253;
+    char path[] = "/tmp/socknanoXXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    unlink(path);
+    REQUIRE(write(fd, content.data(), content.size()) == (ssize_t)content.size());
+
+    size_t offset = 100;
+    size_t length = content.size() - 200;
+    std::thread sender([peer, fd, offset, length] {
+        peer->SendFile(fd, offset, length);
+    });
+    auto data = socket->RecvAll(length);
+    sender.join();
+    REQUIRE(data == std::vector<uint8_t>(content.begin() + offset, content.begin() + offset + length));
+
+    // pipes are spliced to the socket
+    int pipefd[2];
+    REQUIRE(pipe(pipefd) == 0);
+    std::thread writer([&pipefd] {
+        std::string data = "data which comes from a pipe";
+        REQUIRE(write(pipefd[1], data.data(), data.size()) == (ssize_t)data.size());
+    });
+    peer->SendFile(pipefd[0], 0, 28);
+    writer.join();
+    REQUIRE(socket->RecvAllString(28) == "data which comes from a pipe");
+
+    try
+    {
+        peer->SendFile(fd, content.size() - 10, 20);
+        FAIL_CHECK("Expected SendException");
+    }
+    catch (SendException &e)
+    {
+        REQUIRE(std::string(e.what()) == "sendfile error: Unexpected end of file");
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    close(fd);
+}
+
+TEST_CASE("should send zero copy and report completion", "[socket]")
+{
+    auto servSocket = Socket::Create(SOCK_STREAM);
+    uint16_t port = RandomPort();
+    servSocket->Bind(std::make_shared<Address>(port));
+    servSocket->Listen(20);
+
+    auto socket = Socket::Create(SOCK_STREAM);
+    socket->EnableTimeout(2);
+    socket->Connect(std::make_shared<Address>(port));
+    auto peer = servSocket->Accept();
+    peer->EnableTimeout(2);
+
+    if (!peer->EnableZeroCopy())
+    {
+        WARN("SO_ZEROCOPY is not supported, skipping");
+        return;
+    }
+
+    std::vector<uint8_t> content(1024 * 1024);
+    for (size_t i = 0; i < content.size(); ++i)
+        content[i] = i % 251;
+    auto shared = std::make_shared<const std::vector<uint8_t>>(content);
+    std::atomic<int> completed(0);
+
+    std::thread sender([peer, &content, shared, &completed] {
+        peer->SendAllZeroCopy(content.data(), content.size(), [&completed] { ++completed; });
+        peer->SendAllZeroCopy(shared);
+        // below the threshold the data is copied and completes immediately
+        peer->SendAllZeroCopy((const uint8_t *)"small", 5, [&completed] { ++completed; });
+    });
+    auto first = socket->RecvAll(content.size());
+    auto second = socket->RecvAll(content.size());
+    REQUIRE(socket->RecvAllString(5) == "small");
+    sender.join();
+
+    REQUIRE(first == content);
+    REQUIRE(second == content);
+    REQUIRE(peer->ReapZeroCopyCompletions(true) == 0);
+    REQUIRE(completed == 2);
+    REQUIRE(shared.use_count() == 1);
+}
+
+TEST_CASE("should keep zero copy buffers until completion after close", "[socket]")
+{
+    auto servSocket = Socket::Create(SOCK_STREAM);
+    uint16_t port = RandomPort();
+    servSocket->Bind(std::make_shared<Address>(port));
+    servSocket->Listen(20);
+
+    auto socket = Socket::Create(SOCK_STREAM);
+    socket->EnableTimeout(2);
+    socket->Connect(std::make_shared<Address>(port));
+    auto peer = servSocket->Accept();
+
+    if (!peer->EnableZeroCopy())
+    {
+        WARN("SO_ZEROCOPY is not supported, skipping");
+        return;
+    }
+
+    // more than the socket buffers hold, so the tail is unacknowledged until the reader catches up
+    std::vector<uint8_t> content(4 * 1024 * 1024, 'z');
+    std::atomic<int> completed(0);
+    std::thread sender([peer, &content, &completed] {
+        peer->SendAllZeroCopy(content.data(), content.size(), [&completed] { ++completed; });
+    });
+    auto head = socket->RecvAll(content.size() / 2);
+    sender.join();
+    peer->Close();
+    REQUIRE(completed == 0);
+
+    auto tail = socket->RecvAll(content.size() / 2);
+    REQUIRE(head.back() == 'z');
+    REQUIRE(tail.back() == 'z');
+    // the stream still ends once the buffers are released
+    REQUIRE_THROWS_AS(socket->RecvAll(1), SocketConnectionClosedException);
+    for (int i = 0; i < 100 && completed == 0; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    REQUIRE(completed == 1);
+}
+
+TEST_CASE("should allow sending from a zero copy completion", "[socket]")
+{
+    auto servSocket = Socket::Create(SOCK_STREAM);
+    uint16_t port = RandomPort();
+    servSocket->Bind(std::make_shared<Address>(port));
+    servSocket->Listen(20);
+
+    auto socket = Socket::Create(SOCK_STREAM);
+    socket->EnableTimeout(2);
+    socket->Connect(std::make_shared<Address>(port));
+    auto peer = servSocket->Accept();
+    peer->EnableTimeout(2);
+
+    if (!peer->EnableZeroCopy(1))
+    {
+        WARN("SO_ZEROCOPY is not supported, skipping");
+        return;
+    }
+
+    auto first = std::make_shared<const std::vector<uint8_t>>(64 * 1024, 'a');
+    std::atomic<int> completed(0);
+    auto raw = peer.get();
+    std::thread sender([raw, first, &completed] {
+        raw->SendAllZeroCopy(first->data(), first->size(), [raw, &completed] {
+            ++completed;
+            raw->SendAll("done");
+        });
+        raw->SendAllZeroCopy((const uint8_t *)"next", 4, [] {});
+    });
+    auto data = socket->RecvAll(first->size());
+    REQUIRE(data.back() == 'a');
+    sender.join();
+    peer->ReapZeroCopyCompletions(true);
+    REQUIRE(completed == 1);
+    auto rest = socket->RecvAllString(8);
+    REQUIRE((rest == "nextdone" || rest == "donenext"));
+}
+
+TEST_CASE("should send and recv datagram batches", "[socket]")
+{
+    auto servSocket = Socket::Create(SOCK_DGRAM);
+    uint16_t port = RandomPort();
+    auto serverAddr = std::make_shared<Address>(port);
+    servSocket->Bind(serverAddr);
+    servSocket->EnableTimeout(2);
+
+    auto socket = Socket::Create(SOCK_DGRAM);
+    std::vector<Datagram> out(10);
+    for (size_t i = 0; i < out.size(); ++i)
+    {
+        std::string data = "DATAGRAM" + std::to_string(i);
+        out[i].address = serverAddr;
+        out[i].data.assign(data.begin(), data.end());
+    }
+    socket->SendToBatch(out);
+
+    std::vector<Datagram> in(4);
+    size_t received = 0;
+    while (received < out.size())
+    {
+        size_t n = servSocket->RecvFromBatch(in, 64);
+        REQUIRE(n > 0);
+        REQUIRE(n <= in.size());
+        for (size_t i = 0; i < n; ++i, ++received)
+        {
+            REQUIRE(in[i].data == out[received].data);
+            REQUIRE(in[i].address->GetIP() == "127.0.0.1");
+        }
+    }
+}
+
+TEST_CASE("should send segmented and recv coalesced datagrams", "[socket]")
+{
+    auto servSocket = Socket::Create(SOCK_DGRAM);
+    uint16_t port = RandomPort();
+    auto serverAddr = std::make_shared<Address>(port);
+    servSocket->Bind(serverAddr);
+    servSocket->EnableTimeout(2);
+    servSocket->EnableGro();
+
+    // 150 datagrams need more than one GSO send, the last one is shorter
+    std::vector<uint8_t> content(150 * 1000 - 300);
+    for (size_t i = 0; i < content.size(); ++i)
+        content[i] = i % 241;
+    auto socket = Socket::Create(SOCK_DGRAM);
+    socket->SendToSegmented(serverAddr, content.data(), content.size(), 1000);
+
+    std::vector<uint8_t> buf(Socket::maxCoalescedSize);
+    std::vector<uint8_t> received;
+    size_t datagrams = 0;
+    while (received.size() < content.size())
+    {
+        std::shared_ptr<Address> from;
+        size_t segmentSize;
+        size_t n = servSocket->RecvFromCoalesced(from, buf.data(), buf.size(), &segmentSize);
+        for (size_t offset = 0; offset < n; offset += segmentSize, ++datagrams)
+        {
+            size_t len = std::min(segmentSize, n - offset);
+            REQUIRE((len == 1000 || received.size() + len == content.size()));
+            received.insert(received.end(), buf.begin() + offset, buf.begin() + offset + len);
+        }
+    }
+    REQUIRE(datagrams == 150);
+    REQUIRE(received == content);
 }
\ No newline at end of file
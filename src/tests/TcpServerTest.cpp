@@ -2,7 +2,9 @@
 #include "../socknano.h"
 #include <functional>
 #include <atomic>
+#include <algorithm>
 #include "TestUtils.h"
+#include <sys/resource.h>
 
 TEST_CASE("tcp server general test", "[tcp-server]")
 {
@@ -158,5 +160,705 @@ TEST_CASE("should broadcast", "[tcp-server]")
 
     std::this_thread::sleep_for(std::chrono::milliseconds(500));
 
+    REQUIRE(!server->IsListening());
+}
+
+TEST_CASE("event driven server should serve more connections than pool size", "[tcp-server]")
+{
+    class Handler : public TcpEventHandler
+    {
+    public:
+        std::atomic<int> &connected;
+        Handler(std::atomic<int> &connected) : connected(connected) {}
+        virtual void OnConnect() { ++connected; }
+        virtual void OnData(const uint8_t *data, size_t len)
+        {
+            // echo back
+            Send(data, len);
+        }
+        virtual void OnDisconnect() { --connected; }
+    };
+
+    std::atomic<int> connected(0);
+    uint16_t port = RandomPort();
+    auto server = TcpServer::CreateEventDriven([&connected] { return std::make_shared<Handler>(connected); });
+    server->SetThreadPoolSize(1);
+
+    std::thread serverThread([server, port] {
+        server->Listen(port);
+    });
+    serverThread.detach();
+
+    // wait for server
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    REQUIRE(server->IsListening());
+
+    int n = 10;
+    std::vector<std::shared_ptr<Socket>> clients;
+    for (int i = 0; i < n; ++i)
+    {
+        auto client = Socket::Create(SOCK_STREAM);
+        client->EnableTimeout(2);
+        client->Connect(std::make_shared<Address>(port));
+        clients.push_back(client);
+    }
+
+    for (int i = 0; i < n; ++i)
+    {
+        std::string message = "PING" + std::to_string(i);
+        clients[i]->SendAll(message);
+        REQUIRE(clients[i]->RecvAllString(message.size()) == message);
+    }
+
+    REQUIRE(connected.load() == n);
+    REQUIRE(server->GetNumberOfConnections() == (size_t)n);
+
+    clients.clear();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    REQUIRE(connected.load() == 0);
+    REQUIRE(server->GetNumberOfConnections() == 0);
+
+    server->Stop();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    REQUIRE(!server->IsListening());
+}
+
+TEST_CASE("event driven broadcast should not block on slow clients", "[tcp-server]")
+{
+    class Handler : public TcpEventHandler
+    {
+    public:
+        virtual void OnData(const uint8_t *data, size_t len)
+        {
+            if (data[0] == 'B')
+            {
+                // the reply is queued first and has to arrive before the broadcast
+                Send("REPLY");
+                std::string message(1024 * 1024, 'x');
+                server->Broadcast(message);
+            }
+            else
+            {
+                Send(data, len);
+            }
+        }
+    };
+
+    uint16_t port = RandomPort();
+    auto server = TcpServer::CreateEventDriven([] { return std::make_shared<Handler>(); });
+
+    std::thread serverThread([server, port] {
+        server->Listen(port);
+    });
+    serverThread.detach();
+
+    // wait for server
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    // the slow client never reads, its socket buffer fills up
+    auto slow = Socket::Create(SOCK_STREAM);
+    slow->Connect(std::make_shared<Address>(port));
+    auto fast = Socket::Create(SOCK_STREAM);
+    fast->EnableTimeout(2);
+    fast->Connect(std::make_shared<Address>(port));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    fast->SendAll("B");
+    REQUIRE(fast->RecvAllString(5) == "REPLY");
+    std::string message = fast->RecvAllString(1024 * 1024);
+    REQUIRE(message == std::string(1024 * 1024, 'x'));
+
+    // the event loop is not stuck sending to the slow client
+    fast->SendAll("PING");
+    REQUIRE(fast->RecvAllString(4) == "PING");
+
+    server->Stop();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    REQUIRE(!server->IsListening());
+}
+
+TEST_CASE("event driven server should limit output buffers of slow clients", "[tcp-server]")
+{
+    class Handler : public TcpEventHandler
+    {
+    public:
+        virtual void OnData(const uint8_t *data, size_t len)
+        {
+            Send(data, len);
+        }
+    };
+
+    SlowConsumerPolicy policy = SlowConsumerPolicy::Drop;
+    SECTION("drop")
+    {
+        policy = SlowConsumerPolicy::Drop;
+    }
+    SECTION("disconnect")
+    {
+        policy = SlowConsumerPolicy::Disconnect;
+    }
+
+    uint16_t port = RandomPort();
+    auto server = TcpServer::CreateEventDriven([] { return std::make_shared<Handler>(); });
+    server->SetOutputLimit(1024 * 1024, policy);
+    REQUIRE_THROWS_AS(server->SetOutputLimit(1024, SlowConsumerPolicy::Coalesce), TcpServerException);
+
+    std::thread serverThread([server, port] {
+        server->Listen(port);
+    });
+    serverThread.detach();
+
+    // wait for server
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    // the slow client never reads, its socket buffer fills up
+    auto slow = Socket::Create(SOCK_STREAM);
+    slow->Connect(std::make_shared<Address>(port));
+    auto fast = Socket::Create(SOCK_STREAM);
+    fast->EnableTimeout(2);
+    fast->Connect(std::make_shared<Address>(port));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    REQUIRE(server->GetNumberOfConnections() == 2);
+
+    // far more than the socket buffers and the output limit of the slow client hold
+    for (int i = 0; i < 64; ++i)
+    {
+        std::string message(256 * 1024, (char)i);
+        server->Broadcast(message);
+        fast->RecvAllString(message.size());
+    }
+    REQUIRE(server->GetDroppedBroadcasts() > 0);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    REQUIRE(server->GetNumberOfConnections() == (policy == SlowConsumerPolicy::Disconnect ? 1u : 2u));
+    fast->SendAll("PING");
+    REQUIRE(fast->RecvAllString(4) == "PING");
+
+    server->Stop();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    REQUIRE(!server->IsListening());
+}
+
+TEST_CASE("event driven server should survive running out of descriptors", "[tcp-server]")
+{
+    class Handler : public TcpEventHandler
+    {
+    public:
+        virtual void OnData(const uint8_t *data, size_t len) { Send(data, len); }
+    };
+
+    uint16_t port = RandomPort();
+    auto server = TcpServer::CreateEventDriven([] { return std::make_shared<Handler>(); });
+
+    std::thread serverThread([server, port] {
+        server->Listen(port);
+    });
+    serverThread.detach();
+
+    // wait for server
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    auto connected = Socket::Create(SOCK_STREAM);
+    connected->EnableTimeout(2);
+    connected->Connect(std::make_shared<Address>(port));
+    connected->SendAll("PING");
+    REQUIRE(connected->RecvAllString(4) == "PING");
+    auto pending = Socket::Create(SOCK_STREAM);
+    pending->EnableTimeout(2);
+
+    // the lowest free descriptor becomes the limit, so accept fails with EMFILE
+    struct rlimit limit;
+    REQUIRE(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+    struct rlimit lowered = limit;
+    int lowest = dup(0);
+    close(lowest);
+    lowered.rlim_cur = lowest;
+    REQUIRE(setrlimit(RLIMIT_NOFILE, &lowered) == 0);
+
+    pending->Connect(std::make_shared<Address>(port));
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+    // connections which are already served keep working
+    std::string reply;
+    try
+    {
+        connected->SendAll("PING");
+        reply = connected->RecvAllString(4);
+    }
+    catch (std::exception &e)
+    {
+    }
+
+    REQUIRE(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+    REQUIRE(reply == "PING");
+    REQUIRE(server->IsListening());
+    REQUIRE(server->GetAcceptErrors() > 0);
+
+    pending->SendAll("PONG");
+    REQUIRE(pending->RecvAllString(4) == "PONG");
+
+    server->Stop();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    REQUIRE(!server->IsListening());
+}
+
+TEST_CASE("should accept connections on sharded listeners", "[tcp-server]")
+{
+    class Handler : public TcpConnectionHandler
+    {
+    public:
+        virtual void HandleConnection()
+        {
+            auto data = socket->RecvAll(4);
+            socket->SendAll(data);
+        }
+    };
+
+    class EventHandler : public TcpEventHandler
+    {
+    public:
+        virtual void OnData(const uint8_t *data, size_t len) { Send(data, len); }
+    };
+
+    std::shared_ptr<TcpServer> server;
+    SECTION("accept loops")
+    {
+        server = TcpServer::Create([] { return std::make_shared<Handler>(); });
+    }
+    SECTION("event loops")
+    {
+        server = TcpServer::CreateEventDriven([] { return std::make_shared<EventHandler>(); });
+    }
+    server->SetListenerCount(4);
+    server->SetListenerAffinity(true);
+
+    uint16_t port = RandomPort();
+    std::thread serverThread([server, port] {
+        server->Listen(port);
+    });
+    serverThread.detach();
+
+    // wait for server
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    REQUIRE(server->IsListening());
+
+    for (int i = 0; i < 20; ++i)
+    {
+        auto client = Socket::Create(SOCK_STREAM);
+        client->EnableTimeout(2);
+        client->Connect(std::make_shared<Address>(port));
+        client->SendAll("PING");
+        REQUIRE(client->RecvAllString(4) == "PING");
+    }
+
+    server->Stop();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    REQUIRE(!server->IsListening());
+}
+
+TEST_CASE("should share executor with other servers", "[tcp-server]")
+{
+    class Handler : public TcpConnectionHandler
+    {
+    public:
+        virtual void HandleConnection()
+        {
+            auto data = socket->RecvAll(4);
+            socket->SendAll(data);
+        }
+    };
+
+    class DatagramHandler : public UdpDatagramHandler
+    {
+    public:
+        std::atomic<int> &handled;
+        DatagramHandler(std::atomic<int> &handled) : handled(handled) {}
+        virtual void HandleDatagram() { ++handled; }
+    };
+
+    auto executor = std::make_shared<ThreadPool>(2);
+    std::atomic<int> handled(0);
+
+    auto tcpServer = TcpServer::Create([] { return std::make_shared<Handler>(); });
+    auto udpServer = UdpServer::Create([&handled] { return std::make_shared<DatagramHandler>(handled); });
+    tcpServer->SetExecutor(executor);
+    udpServer->SetExecutor(executor);
+
+    uint16_t tcpPort = RandomPort();
+    uint16_t udpPort = RandomPort();
+    std::thread tcpThread([tcpServer, tcpPort] {
+        tcpServer->Listen(tcpPort);
+    });
+    tcpThread.detach();
+    std::thread udpThread([udpServer, udpPort] {
+        udpServer->Listen(udpPort);
+    });
+    udpThread.detach();
+
+    // wait for servers
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    auto udpClient = Socket::Create(SOCK_DGRAM);
+    for (int i = 0; i < 10; ++i)
+    {
+        udpClient->SendTo(std::make_shared<Address>(udpPort), "Test");
+
+        auto client = Socket::Create(SOCK_STREAM);
+        client->EnableTimeout(2);
+        client->Connect(std::make_shared<Address>(tcpPort));
+        client->SendAll("PING");
+        REQUIRE(client->RecvAllString(4) == "PING");
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    REQUIRE(handled.load() == 10);
+
+    tcpServer->Stop();
+    udpServer->Stop();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    // the shared pool outlives the servers
+    REQUIRE(!executor->isHalted());
+    REQUIRE(executor->Submit([] { return 1; }).get() == 1);
+    executor->Shutdown();
+}
+
+TEST_CASE("client registry should add and remove clients concurrently", "[tcp-server]")
+{
+    ClientRegistry registry;
+    std::vector<std::vector<std::shared_ptr<Socket>>> kept(4);
+    std::atomic<int> removed(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&registry, &kept, &removed, t] {
+            for (int i = 0; i < 50; ++i)
+            {
+                auto socket = Socket::Create(SOCK_STREAM);
+                registry.Add(socket);
+                if (i % 2)
+                    kept[t].push_back(socket);
+                else if (registry.Remove(socket))
+                    ++removed;
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    REQUIRE(removed.load() == 100);
+    REQUIRE(registry.Size() == 100);
+    auto snapshot = registry.Snapshot();
+    REQUIRE(snapshot.size() == 100);
+    for (auto &sockets : kept)
+    {
+        for (auto &socket : sockets)
+            REQUIRE(std::find(snapshot.begin(), snapshot.end(), socket) != snapshot.end());
+    }
+
+    REQUIRE(!registry.Remove(Socket::Create(SOCK_STREAM)));
+    REQUIRE(registry.Remove(kept[0][0]));
+    REQUIRE(!registry.Remove(kept[0][0]));
+    REQUIRE(registry.Size() == 99);
+
+    registry.Clear();
+    REQUIRE(registry.Size() == 0);
+    REQUIRE(registry.Snapshot().empty());
+}
+
+TEST_CASE("client registry should remove client closed while registered", "[tcp-server]")
+{
+    ClientRegistry registry;
+    auto client = Socket::Create(SOCK_STREAM);
+    REQUIRE(registry.Add(client));
+    REQUIRE(registry.Size() == 1);
+
+    client->Close();
+    REQUIRE(client->GetSocket() == -1);
+    REQUIRE(registry.Size() == 0);
+    REQUIRE(registry.Remove(client));
+    REQUIRE(registry.Size() == 0);
+    REQUIRE(!registry.Remove(client));
+    REQUIRE(!registry.Add(client));
+}
+
+TEST_CASE("client registry should replace closed client whose descriptor is reused", "[tcp-server]")
+{
+    ClientRegistry registry;
+    auto closed = Socket::Create(SOCK_STREAM);
+    int fd = closed->GetSocket();
+    REQUIRE(registry.Add(closed));
+    closed->Close();
+    REQUIRE(registry.Size() == 0);
+
+    // the lowest free descriptor is handed out again
+    auto client = Socket::Create(SOCK_STREAM);
+    REQUIRE(client->GetSocket() == fd);
+    REQUIRE(registry.Add(client));
+    REQUIRE(registry.Size() == 1);
+    REQUIRE(registry.Snapshot() == std::vector<std::shared_ptr<Socket>>({client}));
+
+    REQUIRE(!registry.Remove(closed));
+    REQUIRE(registry.Remove(client));
+    REQUIRE(registry.Size() == 0);
+}
+
+TEST_CASE("client registry should reject second socket on a registered descriptor", "[tcp-server]")
+{
+    ClientRegistry registry;
+    auto client = Socket::Create(SOCK_STREAM);
+    auto other = std::make_shared<Socket>(client->GetSocket());
+    REQUIRE(registry.Add(client));
+    REQUIRE(registry.Add(client));
+    REQUIRE(!registry.Add(other));
+    REQUIRE(registry.Size() == 1);
+    REQUIRE(registry.Snapshot() == std::vector<std::shared_ptr<Socket>>({client}));
+
+    // both refer to one descriptor, only the first close releases it
+    other->Close();
+    REQUIRE_NOTHROW(client->Close());
+}
+
+TEST_CASE("async broadcast should not wait for slow clients", "[tcp-server]")
+{
+    class Handler : public TcpConnectionHandler
+    {
+    public:
+        virtual void HandleConnection()
+        {
+            // keep connected until the peer or the server closes the connection
+            try
+            {
+                socket->RecvAll(1);
+            }
+            catch (std::exception &e)
+            {
+            }
+        }
+    };
+
+    const size_t messageSize = 256 * 1024;
+    const int messages = 100;
+
+    SlowConsumerPolicy policy = SlowConsumerPolicy::Drop;
+    SECTION("drop")
+    {
+        policy = SlowConsumerPolicy::Drop;
+    }
+    SECTION("disconnect")
+    {
+        policy = SlowConsumerPolicy::Disconnect;
+    }
+    SECTION("coalesce")
+    {
+        policy = SlowConsumerPolicy::Coalesce;
+    }
+
+    uint16_t port = RandomPort();
+    auto server = TcpServer::Create([] { return std::make_shared<Handler>(); });
+    server->SetAsyncBroadcast(2, 16, policy);
+
+    std::thread serverThread([server, port] {
+        server->Listen(port);
+    });
+    serverThread.detach();
+
+    // wait for server
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    auto fast = Socket::Create(SOCK_STREAM);
+    auto slow = Socket::Create(SOCK_STREAM);
+    fast->EnableTimeout(5);
+    fast->Connect(std::make_shared<Address>(port));
+    slow->Connect(std::make_shared<Address>(port));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    REQUIRE(server->GetNumberOfConnections() == 2);
+
+    // the fast client reads everything while the slow one never reads
+    int intact = 0;
+    std::thread reader([fast, &intact, messageSize, messages] {
+        try
+        {
+            for (int i = 0; i < messages; ++i)
+            {
+                auto data = fast->RecvAll(messageSize);
+                if (data.front() == (uint8_t)i && data.back() == (uint8_t)i)
+                    ++intact;
+            }
+        }
+        catch (std::exception &e)
+        {
+        }
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < messages; ++i)
+    {
+        std::string message(messageSize, (char)i);
+        server->Broadcast(message);
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    reader.join();
+
+    REQUIRE(intact == messages);
+    REQUIRE(elapsed < std::chrono::seconds(5));
+    REQUIRE(server->GetDroppedBroadcasts() > 0);
+    if (policy == SlowConsumerPolicy::Disconnect)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        REQUIRE(server->GetNumberOfConnections() == 1);
+    }
+
+    server->Stop();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    REQUIRE(!server->IsListening());
+}
+
+TEST_CASE("async broadcast should coalesce behind a half sent message", "[tcp-server]")
+{
+    class Handler : public TcpConnectionHandler
+    {
+    public:
+        virtual void HandleConnection()
+        {
+            try
+            {
+                socket->RecvAll(1);
+            }
+            catch (std::exception &e)
+            {
+            }
+        }
+    };
+
+    // larger than the socket buffers, the first message stays half sent until the client reads
+    const size_t messageSize = 8 * 1024 * 1024;
+
+    uint16_t port = RandomPort();
+    auto server = TcpServer::Create([] { return std::make_shared<Handler>(); });
+    server->SetAsyncBroadcast(1, 1, SlowConsumerPolicy::Coalesce);
+
+    std::thread serverThread([server, port] {
+        server->Listen(port);
+    });
+    serverThread.detach();
+
+    // wait for server
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    auto client = Socket::Create(SOCK_STREAM);
+    int rcvbuf = 4096;
+    setsockopt(client->GetSocket(), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    client->EnableTimeout(5);
+    client->Connect(std::make_shared<Address>(port));
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    for (int i = 0; i < 4; ++i)
+    {
+        std::string message(messageSize, (char)i);
+        server->Broadcast(message);
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+
+    // a limit of one message still keeps the latest one next to the half sent front
+    auto first = client->RecvAll(messageSize);
+    auto latest = client->RecvAll(messageSize);
+    REQUIRE(std::count(first.begin(), first.end(), 0) == (long)messageSize);
+    REQUIRE(std::count(latest.begin(), latest.end(), 3) == (long)messageSize);
+    REQUIRE(server->GetDroppedBroadcasts() == 2);
+
+    server->Stop();
+}
+
+TEST_CASE("async broadcast should not split messages the handler sends", "[tcp-server]")
+{
+    const size_t messageSize = 128 * 1024;
+    const int messages = 40;
+
+    class Handler : public TcpConnectionHandler
+    {
+    public:
+        virtual void HandleConnection()
+        {
+            try
+            {
+                socket->RecvAll(1);
+                for (int i = 0; i < messages; ++i)
+                    socket->SendAll(std::string(messageSize, 'H'));
+                socket->RecvAll(1);
+            }
+            catch (std::exception &e)
+            {
+            }
+        }
+    };
+
+    uint16_t port = RandomPort();
+    auto server = TcpServer::Create([] { return std::make_shared<Handler>(); });
+    server->SetAsyncBroadcast(2, messages, SlowConsumerPolicy::Drop);
+
+    std::thread serverThread([server, port] {
+        server->Listen(port);
+    });
+    serverThread.detach();
+
+    // wait for server
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    auto client = Socket::Create(SOCK_STREAM);
+    client->EnableTimeout(5);
+    client->Connect(std::make_shared<Address>(port));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    // the handler and the broadcasts fill the socket buffer before the client starts reading
+    client->SendAll("G");
+    for (int i = 0; i < messages; ++i)
+    {
+        std::string message(messageSize, 'B');
+        server->Broadcast(message);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    int handled = 0;
+    int broadcasts = 0;
+    bool intact = true;
+    for (int i = 0; i < 2 * messages; ++i)
+    {
+        auto data = client->RecvAll(messageSize);
+        intact = intact && std::all_of(data.begin(), data.end(), [&data](uint8_t c) { return c == data.front(); });
+        if (data.front() == 'H')
+            ++handled;
+        else
+            ++broadcasts;
+    }
+    client->SendAll("E");
+
+    REQUIRE(intact);
+    REQUIRE(handled == messages);
+    REQUIRE(broadcasts == messages);
+
+    server->Stop();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
     REQUIRE(!server->IsListening());
 }
\ No newline at end of file
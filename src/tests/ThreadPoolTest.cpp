@@ -2,6 +2,7 @@
 #include "../socknano.h"
 #include <functional>
 #include <atomic>
+#include <algorithm>
 
 TEST_CASE("should run task", "[tp]")
 {
@@ -59,4 +60,529 @@ TEST_CASE("should start eventually", "[tp]")
     tp.Shutdown();
 
     REQUIRE(tp.isHalted());
+}
+
+TEST_CASE("should run every task once with nested submissions", "[tp]")
+{
+    ThreadPool tp(8);
+
+    int outer = 200;
+    int inner = 50;
+    std::atomic<int> done(0);
+    for (int i = 0; i < outer; ++i)
+    {
+        tp.SubmitTask([&tp, &done, inner] {
+            // tasks spawned by workers go to their own deque and are stolen by idle ones
+            for (int j = 0; j < inner; ++j)
+                tp.SubmitTask([&done] { ++done; });
+            ++done;
+        });
+    }
+
+    for (int i = 0; i < 100 && done.load() < outer * (inner + 1); ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    tp.Shutdown();
+
+    REQUIRE(done.load() == outer * (inner + 1));
+}
+
+TEST_CASE("work stealing deque should hand out every element once", "[tp]")
+{
+    WorkStealingDeque<int> deque(64);
+    int n = 100000;
+    std::vector<std::atomic<int>> taken(n);
+    for (auto &t : taken)
+        t = 0;
+    std::atomic<bool> finished(false);
+
+    std::vector<std::thread> thieves;
+    for (int i = 0; i < 3; ++i)
+    {
+        thieves.emplace_back([&deque, &taken, &finished] {
+            int item;
+            while (!finished.load())
+            {
+                if (deque.Steal(item))
+                    ++taken[item];
+            }
+        });
+    }
+
+    int item;
+    for (int i = 0; i < n; ++i)
+    {
+        int value = i;
+        while (!deque.Push(std::move(value)))
+        {
+            if (deque.Pop(item))
+                ++taken[item];
+        }
+        if (i % 3 == 0 && deque.Pop(item))
+            ++taken[item];
+    }
+    while (deque.Pop(item))
+        ++taken[item];
+    finished = true;
+    for (auto &thief : thieves)
+        thief.join();
+
+    int wrong = 0;
+    for (int i = 0; i < n; ++i)
+        wrong += taken[i].load() != 1;
+    REQUIRE(wrong == 0);
+}
+
+TEST_CASE("task should store small callables inline", "[tp]")
+{
+    int calls = 0;
+    auto shared = std::make_shared<int>(1);
+    Task small([&calls, shared] { calls += *shared; });
+    REQUIRE(small.IsInline());
+
+    char big[2 * Task::inlineSize] = {1};
+    Task large([&calls, big] { calls += big[0]; });
+    REQUIRE(!large.IsInline());
+
+    // move-only callables are accepted
+    std::unique_ptr<int> owned(new int(1));
+    Task moveOnly([&calls, owned = std::move(owned)] { calls += *owned; });
+
+    Task moved(std::move(small));
+    REQUIRE(!small);
+    moved();
+    large();
+    moveOnly();
+    REQUIRE(calls == 3);
+
+    moved = Task();
+    REQUIRE(shared.use_count() == 1);
+}
+
+TEST_CASE("should apply overflow policy when the queue is full", "[tp]")
+{
+    std::atomic<bool> busy(false);
+    std::atomic<bool> release(false);
+    std::vector<int> executed;
+    std::mutex executedMtx;
+    auto occupy = [&busy, &release] {
+        busy = true;
+        while (!release.load())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    };
+    auto record = [&executed, &executedMtx](int i) {
+        return [&executed, &executedMtx, i] {
+            std::lock_guard<std::mutex> lock(executedMtx);
+            executed.push_back(i);
+        };
+    };
+
+    SECTION("drop newest")
+    {
+        ThreadPool tp(1, 4, OverflowPolicy::DropNewest);
+        tp.SubmitTask(occupy);
+        while (!busy.load())
+            std::this_thread::yield();
+        for (int i = 0; i < 10; ++i)
+            tp.SubmitTask(record(i));
+        release = true;
+        tp.Shutdown();
+
+        REQUIRE(tp.GetDroppedTasks() == 6);
+        REQUIRE(executed == std::vector<int>({0, 1, 2, 3}));
+    }
+
+    SECTION("drop oldest")
+    {
+        ThreadPool tp(1, 4, OverflowPolicy::DropOldest);
+        tp.SubmitTask(occupy);
+        while (!busy.load())
+            std::this_thread::yield();
+        for (int i = 0; i < 10; ++i)
+            tp.SubmitTask(record(i));
+        release = true;
+        tp.Shutdown();
+
+        REQUIRE(tp.GetDroppedTasks() == 6);
+        REQUIRE(executed == std::vector<int>({6, 7, 8, 9}));
+    }
+
+    SECTION("caller runs")
+    {
+        ThreadPool tp(1, 4, OverflowPolicy::CallerRuns);
+        tp.SubmitTask(occupy);
+        while (!busy.load())
+            std::this_thread::yield();
+        for (int i = 0; i < 10; ++i)
+            tp.SubmitTask(record(i));
+        // tasks which did not fit have already run here
+        REQUIRE(executed == std::vector<int>({4, 5, 6, 7, 8, 9}));
+        release = true;
+        tp.Shutdown();
+
+        REQUIRE(tp.GetCallerRunTasks() == 6);
+        REQUIRE(executed.size() == 10);
+    }
+
+    SECTION("block")
+    {
+        ThreadPool tp(1, 4, OverflowPolicy::Block);
+        tp.SubmitTask(occupy);
+        while (!busy.load())
+            std::this_thread::yield();
+        std::atomic<int> submitted(0);
+        std::thread submitter([&tp, &submitted, &record] {
+            for (int i = 0; i < 10; ++i)
+            {
+                tp.SubmitTask(record(i));
+                ++submitted;
+            }
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        REQUIRE(submitted.load() == 4);
+        release = true;
+        submitter.join();
+        tp.Shutdown();
+
+        REQUIRE(tp.GetDroppedTasks() == 0);
+        REQUIRE(executed == std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
+    }
+}
+
+TEST_CASE("should return results through futures", "[tp]")
+{
+    ThreadPool tp(4);
+
+    std::vector<std::future<int>> results;
+    for (int i = 0; i < 100; ++i)
+        results.push_back(tp.Submit([i] { return i * i; }));
+    for (int i = 0; i < 100; ++i)
+        REQUIRE(results[i].get() == i * i);
+
+    auto failing = tp.Submit([]() -> int { throw std::runtime_error("failed"); });
+    REQUIRE_THROWS_AS(failing.get(), std::runtime_error);
+
+    // tasks dropped by the overflow policy break their promise
+    ThreadPool bounded(1, 1, OverflowPolicy::DropNewest);
+    std::atomic<bool> release(false);
+    bounded.SubmitTask([&release] {
+        while (!release.load())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto queued = bounded.Submit([] { return 1; });
+    auto dropped = bounded.Submit([] { return 2; });
+    REQUIRE_THROWS_AS(dropped.get(), std::future_error);
+    release = true;
+    REQUIRE(queued.get() == 1);
+}
+
+TEST_CASE("should submit batch of tasks", "[tp]")
+{
+    ThreadPool tp(4);
+
+    std::atomic<int> done(0);
+    std::vector<std::function<void()>> batch(1000, [&done] { ++done; });
+    tp.SubmitBatch(batch.begin(), batch.end());
+
+    // batches submitted by workers land in their own deque
+    tp.SubmitTask([&tp, &done] {
+        std::vector<Task> nested;
+        for (int i = 0; i < 2000; ++i)
+            nested.emplace_back([&done] { ++done; });
+        tp.SubmitTasks(nested);
+    });
+
+    for (int i = 0; i < 100 && done.load() < 3000; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    tp.Shutdown();
+
+    REQUIRE(done.load() == 3000);
+}
+
+TEST_CASE("should pin workers to cpus", "[tp]")
+{
+    REQUIRE(CpuAffinity::ParseCpuList("0-3,8,10-11\n") == std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+    REQUIRE(!CpuAffinity::GetNumaNodes().empty());
+
+    std::vector<int> allowed = CpuAffinity::GetAllowedCpus();
+    REQUIRE(!allowed.empty());
+
+    ThreadPool tp(2);
+    tp.PinWorkers({allowed.back()});
+    std::vector<std::future<int>> cpus;
+    for (int i = 0; i < 8; ++i)
+        cpus.push_back(tp.Submit([] { return sched_getcpu(); }));
+    for (auto &cpu : cpus)
+        REQUIRE(cpu.get() == allowed.back());
+    tp.Shutdown();
+}
+
+TEST_CASE("elastic pool should grow while tasks wait and shrink when idle", "[tp]")
+{
+    ThreadPool tp(1, 4, 0, OverflowPolicy::Block);
+    tp.SetGrowthThreshold(std::chrono::milliseconds(10));
+    tp.SetIdleTimeout(std::chrono::milliseconds(200));
+    REQUIRE(tp.GetWorkerCount() == 1);
+
+    // blocking tasks only finish when all of them run at the same time
+    std::atomic<int> running(0);
+    std::vector<std::future<void>> done;
+    for (int i = 0; i < 4; ++i)
+    {
+        done.push_back(tp.Submit([&running] {
+            ++running;
+            while (running.load() < 4)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }));
+    }
+    for (auto &f : done)
+        REQUIRE(f.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+    REQUIRE(tp.GetWorkerCount() == 4);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    REQUIRE(tp.GetWorkerCount() == 1);
+
+    // retired slots are reused
+    std::atomic<int> count(0);
+    for (int i = 0; i < 100; ++i)
+        tp.SubmitTask([&count] { ++count; });
+    tp.Shutdown();
+    REQUIRE(count.load() == 100);
+}
+
+TEST_CASE("spinning workers should not lose wakeups", "[tp]")
+{
+    ThreadPool tp(4);
+    tp.SetSpinWait(std::chrono::microseconds(200));
+
+    // one by one handoffs, which mostly meet a spinning worker
+    for (int i = 0; i < 1000; ++i)
+        REQUIRE(tp.Submit([i] { return i; }).get() == i);
+
+    // bursts and pauses, tasks submitted while a worker spins must wake the others
+    std::atomic<int> count(0);
+    for (int round = 0; round < 20; ++round)
+    {
+        std::vector<std::future<void>> done;
+        for (int i = 0; i < 50; ++i)
+            done.push_back(tp.Submit([&count] {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                ++count;
+            }));
+        for (auto &f : done)
+            REQUIRE(f.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+        std::this_thread::sleep_for(std::chrono::microseconds(round * 50));
+    }
+    tp.Shutdown();
+    REQUIRE(count.load() == 1000);
+}
+
+TEST_CASE("spinning worker should pass the wakeup on to a parked one", "[tp]")
+{
+    ThreadPool tp(2);
+    tp.SetSpinWait(std::chrono::seconds(3));
+
+    // one worker spins and the other one parks
+    tp.Submit([] {}).get();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    // both tasks are submitted while the worker spins, so neither of them wakes the parked worker
+    auto start = std::chrono::steady_clock::now();
+    auto slow = tp.Submit([] { std::this_thread::sleep_for(std::chrono::seconds(1)); });
+    auto fast = tp.Submit([] { return std::chrono::steady_clock::now(); });
+    auto waited = fast.get() - start;
+    slow.get();
+    tp.Shutdown();
+
+    REQUIRE(waited < std::chrono::milliseconds(500));
+}
+
+TEST_CASE("should run tasks by priority and drop expired ones", "[tp]")
+{
+    ThreadPool tp(1);
+    std::atomic<bool> release(false);
+    std::mutex mtx;
+    std::vector<std::string> order;
+    auto record = [&mtx, &order](const std::string &name) {
+        std::lock_guard<std::mutex> lock(mtx);
+        order.push_back(name);
+    };
+
+    // keep the only worker busy while the queues fill up
+    tp.SubmitTask([&release] {
+        while (!release.load())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    auto now = std::chrono::steady_clock::now();
+    tp.SubmitTask([&record] { record("low"); }, TaskPriority::Low);
+    tp.SubmitTask([&record] { record("normal"); });
+    tp.SubmitTask([&record] { record("high"); }, TaskPriority::High);
+    auto expired = tp.Submit([&record] { record("expired"); }, TaskPriority::High, now + std::chrono::milliseconds(10));
+    auto timely = tp.Submit([&record] { record("timely"); }, TaskPriority::Normal, now + std::chrono::seconds(60));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    release = true;
+    timely.get();
+    REQUIRE_THROWS_AS(expired.get(), std::future_error);
+    tp.Shutdown();
+
+    REQUIRE(order == std::vector<std::string>({"high", "normal", "timely", "low"}));
+    REQUIRE(tp.GetExpiredTasks() == 1);
+}
+
+TEST_CASE("should serve lanes in turns", "[tp]")
+{
+    ThreadPool tp(1);
+    size_t bulkLane = tp.AddLane();
+    size_t otherLane = tp.AddLane();
+    REQUIRE(bulkLane != 0);
+    REQUIRE(otherLane != bulkLane);
+
+    std::atomic<bool> release(false);
+    tp.SubmitTask([&release] {
+        while (!release.load())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // a backlog on one lane does not hold back the other one
+    std::mutex mtx;
+    std::vector<size_t> order;
+    for (size_t lane : {bulkLane, bulkLane, bulkLane, bulkLane, bulkLane, bulkLane, otherLane, otherLane})
+    {
+        tp.SubmitTask([&mtx, &order, lane] {
+            std::lock_guard<std::mutex> lock(mtx);
+            order.push_back(lane);
+        }, TaskPriority::Normal, std::chrono::steady_clock::time_point(), lane);
+    }
+    release = true;
+    tp.Shutdown();
+
+    REQUIRE(order.size() == 8);
+    REQUIRE(std::count(order.begin(), order.begin() + 4, otherLane) == 2);
+}
+
+TEST_CASE("should queue batches on their lane", "[tp]")
+{
+    ThreadPool tp(1);
+    size_t bulkLane = tp.AddLane();
+    size_t otherLane = tp.AddLane();
+
+    std::atomic<bool> release(false);
+    tp.SubmitTask([&release] {
+        while (!release.load())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // a batch on one lane is served in turns with the other lane, like single tasks are
+    std::mutex mtx;
+    std::vector<size_t> order;
+    auto record = [&mtx, &order](size_t lane) {
+        return [&mtx, &order, lane] {
+            std::lock_guard<std::mutex> lock(mtx);
+            order.push_back(lane);
+        };
+    };
+    std::vector<std::function<void()>> bulk(6, record(bulkLane));
+    tp.SubmitBatch(bulk.begin(), bulk.end(), bulkLane);
+    std::vector<Task> other;
+    other.emplace_back(record(otherLane));
+    other.emplace_back(record(otherLane));
+    tp.SubmitTasks(other, otherLane);
+    release = true;
+    tp.Shutdown();
+
+    REQUIRE(order.size() == 8);
+    REQUIRE(std::count(order.begin(), order.begin() + 4, otherLane) == 2);
+}
+
+TEST_CASE("spsc ring should hand over every element in order", "[tp]")
+{
+    SpscRing<int> ring(100);
+    REQUIRE(ring.Empty());
+
+    // capacity is rounded up to 128
+    for (int i = 0; i < 128; ++i)
+    {
+        int *slot = ring.Claim();
+        REQUIRE(slot != nullptr);
+        *slot = i;
+        ring.Publish();
+    }
+    REQUIRE(ring.Claim() == nullptr);
+    REQUIRE(ring.Size() == 128);
+    for (int i = 0; i < 128; ++i)
+    {
+        REQUIRE(*ring.Front() == i);
+        ring.Pop();
+    }
+    REQUIRE(ring.Front() == nullptr);
+
+    // slots claimed ahead are filled first and published together
+    for (int i = 0; i < 128; ++i)
+    {
+        int *slot = ring.Claim(i);
+        REQUIRE(slot != nullptr);
+        *slot = i;
+    }
+    REQUIRE(ring.Claim(128) == nullptr);
+    REQUIRE(ring.Empty());
+    ring.Publish(128);
+    for (int i = 0; i < 128; ++i)
+    {
+        REQUIRE(*ring.Front() == i);
+        ring.Pop();
+    }
+
+    const int count = 1000000;
+    std::thread producer([&ring] {
+        for (int i = 0; i < count; ++i)
+        {
+            int *slot;
+            while (!(slot = ring.Claim()))
+                std::this_thread::yield();
+            *slot = i;
+            ring.Publish();
+        }
+    });
+    bool ordered = true;
+    for (int i = 0; i < count; ++i)
+    {
+        int *slot;
+        while (!(slot = ring.Front()))
+            std::this_thread::yield();
+        ordered = ordered && *slot == i;
+        ring.Pop();
+    }
+    producer.join();
+    REQUIRE(ordered);
+    REQUIRE(ring.Empty());
+}
+
+TEST_CASE("should hand removed lanes out again", "[tp]")
+{
+    ThreadPool tp(1);
+    size_t first = tp.AddLane();
+    size_t second = tp.AddLane();
+    tp.RemoveLane(first);
+    REQUIRE(tp.AddLane() == first);
+    tp.RemoveLane(0);
+    REQUIRE(tp.AddLane() != 0);
+
+    // many submitters coming and going do not use up the lanes
+    for (int i = 0; i < 1000; ++i)
+    {
+        size_t lane = tp.AddLane();
+        REQUIRE(lane != 0);
+        tp.RemoveLane(lane);
+    }
+
+    // tasks left on a removed lane still run
+    std::promise<void> done;
+    tp.RemoveLane(second);
+    tp.SubmitTask([&done] { done.set_value(); }, TaskPriority::Normal, std::chrono::steady_clock::time_point(), second);
+    REQUIRE(done.get_future().wait_for(std::chrono::seconds(2)) == std::future_status::ready);
 }
\ No newline at end of file
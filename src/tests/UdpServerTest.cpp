@@ -2,7 +2,9 @@
 #include "../socknano.h"
 #include <functional>
 #include <atomic>
+#include <algorithm>
 #include "TestUtils.h"
+#include <sys/resource.h>
 
 TEST_CASE("udp server general test", "[udp-server]")
 {
@@ -100,4 +102,399 @@ TEST_CASE("should transfer datagram properly", "[udp-server]")
     std::this_thread::sleep_for(std::chrono::milliseconds(500));
 
     REQUIRE(!server->IsListening());
+}
+
+TEST_CASE("should handle datagrams in place using io_uring multishot receive", "[udp-server]")
+{
+    class Handler : public UdpDatagramHandler
+    {
+    public:
+        std::atomic<int> &handled;
+        Handler(std::atomic<int> &handled) : handled(handled) {}
+        virtual void HandleDatagram() {}
+        virtual void HandleDatagramView(const uint8_t *data, size_t len, const struct sockaddr_in &from)
+        {
+            ++handled;
+            socket->SendTo(std::make_shared<Address>(from), data, len);
+        }
+    };
+
+    std::atomic<int> handled(0);
+    uint16_t port = RandomPort();
+    auto server = UdpServer::Create([&handled] { return std::make_shared<Handler>(handled); });
+    server->SetReceiveMode(UdpReceiveMode::IoUringMultishot);
+
+    std::thread serverThread([server, port] {
+        server->Listen(port);
+    });
+    serverThread.detach();
+
+    // wait for server
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    REQUIRE(server->IsListening());
+
+    auto socket = Socket::Create(SOCK_DGRAM);
+    socket->EnableTimeout(2);
+    auto serverAddr = std::make_shared<Address>(port);
+
+    int n = 1000;
+    for (int i = 0; i < n; ++i)
+    {
+        std::string datagram = "DATAGRAM" + std::to_string(i);
+        socket->SendTo(serverAddr, datagram);
+        auto data = socket->RecvFrom(serverAddr, 64);
+        REQUIRE(std::string(data.begin(), data.end()) == datagram);
+    }
+
+    if (IoUring::IsSupported())
+        REQUIRE(handled.load() == n);
+
+    server->Stop();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    REQUIRE(!server->IsListening());
+}
+
+TEST_CASE("should handle datagrams received in batches", "[udp-server]")
+{
+    class Handler : public UdpDatagramHandler
+    {
+    public:
+        std::atomic<int> &handled;
+        Handler(std::atomic<int> &handled) : handled(handled) {}
+        virtual void HandleDatagram()
+        {
+            ++handled;
+            socket->SendTo(address, datagram);
+        }
+    };
+
+    std::atomic<int> handled(0);
+    uint16_t port = RandomPort();
+    auto server = UdpServer::Create([&handled] { return std::make_shared<Handler>(handled); });
+    server->SetReceiveMode(UdpReceiveMode::Batched);
+    server->SetBatchSize(16);
+
+    std::thread serverThread([server, port] {
+        server->Listen(port);
+    });
+    serverThread.detach();
+
+    // wait for server
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    REQUIRE(server->IsListening());
+
+    auto socket = Socket::Create(SOCK_DGRAM);
+    socket->EnableTimeout(2);
+    auto serverAddr = std::make_shared<Address>(port);
+
+    int n = 100;
+    std::vector<Datagram> batch(n);
+    for (int i = 0; i < n; ++i)
+    {
+        std::string datagram = "DATAGRAM" + std::to_string(i);
+        batch[i].address = serverAddr;
+        batch[i].data.assign(datagram.begin(), datagram.end());
+    }
+    socket->SendToBatch(batch);
+
+    std::vector<Datagram> replies(n);
+    int received = 0;
+    while (received < n)
+        received += socket->RecvFromBatch(replies, 64);
+
+    REQUIRE(handled.load() == n);
+
+    server->Stop();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    REQUIRE(!server->IsListening());
+}
+
+TEST_CASE("should split coalesced datagrams before handling", "[udp-server]")
+{
+    class Handler : public UdpDatagramHandler
+    {
+    public:
+        std::atomic<int> &handled;
+        Handler(std::atomic<int> &handled) : handled(handled) {}
+        virtual void HandleDatagram()
+        {
+            if (datagram == std::string(100, 'x'))
+                ++handled;
+        }
+    };
+
+    std::atomic<int> handled(0);
+    uint16_t port = RandomPort();
+    auto server = UdpServer::Create([&handled] { return std::make_shared<Handler>(handled); });
+    server->SetGro(true);
+    SECTION("default")
+    {
+    }
+    SECTION("batched")
+    {
+        server->SetReceiveMode(UdpReceiveMode::Batched);
+    }
+    SECTION("reuseport")
+    {
+        server->SetReceiveMode(UdpReceiveMode::ReusePort);
+        server->SetListenerCount(2);
+    }
+    SECTION("pipeline")
+    {
+        server->SetReceiveMode(UdpReceiveMode::Pipeline);
+        server->SetThreadPoolSize(2);
+    }
+
+    std::thread serverThread([server, port] {
+        server->Listen(port);
+    });
+    serverThread.detach();
+
+    // wait for server
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    REQUIRE(server->IsListening());
+
+    auto socket = Socket::Create(SOCK_DGRAM);
+    std::vector<uint8_t> content(20 * 100, 'x');
+    socket->SendToSegmented(std::make_shared<Address>(port), content.data(), content.size(), 100);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    REQUIRE(handled.load() == 20);
+
+    server->Stop();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    REQUIRE(!server->IsListening());
+}
+
+TEST_CASE("should reject GRO with io_uring multishot receive", "[udp-server]")
+{
+    class Handler : public UdpDatagramHandler
+    {
+    public:
+        virtual void HandleDatagram() {}
+    };
+
+    auto server = UdpServer::Create([] { return std::make_shared<Handler>(); });
+    server->SetReceiveMode(UdpReceiveMode::IoUringMultishot);
+    server->SetGro(true);
+    REQUIRE_THROWS_AS(server->Listen(RandomPort()), UdpServerException);
+    REQUIRE(!server->IsListening());
+}
+
+TEST_CASE("should handle datagrams on per-thread reuseport sockets", "[udp-server]")
+{
+    class Handler : public UdpDatagramHandler
+    {
+    public:
+        std::atomic<int> &handled;
+        Handler(std::atomic<int> &handled) : handled(handled) {}
+        virtual void HandleDatagram()
+        {
+            ++handled;
+            socket->SendTo(address, datagram);
+        }
+    };
+
+    std::atomic<int> handled(0);
+    uint16_t port = RandomPort();
+    auto server = UdpServer::Create([&handled] { return std::make_shared<Handler>(handled); });
+    server->SetReceiveMode(UdpReceiveMode::ReusePort);
+    server->SetListenerCount(4);
+    server->SetListenerAffinity(true);
+
+    std::thread serverThread([server, port] {
+        server->Listen(port);
+    });
+    serverThread.detach();
+
+    // wait for server
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    REQUIRE(server->IsListening());
+
+    // flows from different source ports are spread across the sockets
+    auto serverAddr = std::make_shared<Address>(port);
+    int n = 0;
+    for (int c = 0; c < 8; ++c)
+    {
+        auto socket = Socket::Create(SOCK_DGRAM);
+        socket->EnableTimeout(2);
+        for (int i = 0; i < 10; ++i, ++n)
+        {
+            std::string datagram = "DATAGRAM" + std::to_string(n);
+            socket->SendTo(serverAddr, datagram);
+            auto data = socket->RecvFrom(serverAddr, 64);
+            REQUIRE(std::string(data.begin(), data.end()) == datagram);
+        }
+    }
+
+    REQUIRE(handled.load() == n);
+
+    server->Stop();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    REQUIRE(!server->IsListening());
+}
+
+TEST_CASE("should release reuseport sockets when listening fails", "[udp-server]")
+{
+    class Handler : public UdpDatagramHandler
+    {
+    public:
+        virtual void HandleDatagram() {}
+    };
+
+    uint16_t port = RandomPort();
+    auto server = UdpServer::Create([] { return std::make_shared<Handler>(); });
+    server->SetReceiveMode(UdpReceiveMode::ReusePort);
+    server->SetListenerCount(8);
+
+    // only two descriptors are left, so the third socket can't be created
+    struct rlimit limit;
+    REQUIRE(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+    struct rlimit lowered = limit;
+    int lowest = dup(0);
+    close(lowest);
+    lowered.rlim_cur = lowest + 2;
+    REQUIRE(setrlimit(RLIMIT_NOFILE, &lowered) == 0);
+    bool failed = false;
+    try
+    {
+        server->Listen(port);
+    }
+    catch (SocketException &e)
+    {
+        failed = true;
+    }
+    REQUIRE(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+    REQUIRE(failed);
+    REQUIRE(!server->IsListening());
+
+    // the sockets bound before the failure are closed
+    int free = dup(0);
+    close(free);
+    REQUIRE(free == lowest);
+}
+
+TEST_CASE("should hand datagrams over to pipeline workers", "[udp-server]")
+{
+    class Handler : public UdpDatagramHandler
+    {
+    public:
+        std::atomic<int> &handled;
+        Handler(std::atomic<int> &handled) : handled(handled) {}
+        virtual void HandleDatagram()
+        {
+            ++handled;
+            socket->SendTo(address, datagram);
+        }
+    };
+
+    std::atomic<int> handled(0);
+    uint16_t port = RandomPort();
+    auto server = UdpServer::Create([&handled] { return std::make_shared<Handler>(handled); });
+    server->SetReceiveMode(UdpReceiveMode::Pipeline);
+    server->SetThreadPoolSize(4);
+    bool ordered = false;
+    SECTION("round robin")
+    {
+        server->SetPipelineDispatch(UdpPipelineDispatch::RoundRobin);
+    }
+    SECTION("flow hash")
+    {
+        server->SetPipelineDispatch(UdpPipelineDispatch::FlowHash);
+        ordered = true;
+    }
+
+    std::thread serverThread([server, port] {
+        server->Listen(port);
+    });
+    serverThread.detach();
+
+    // wait for server
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    REQUIRE(server->IsListening());
+
+    auto serverAddr = std::make_shared<Address>(port);
+    int n = 0;
+    for (int c = 0; c < 4; ++c)
+    {
+        auto socket = Socket::Create(SOCK_DGRAM);
+        socket->EnableTimeout(2);
+        std::vector<std::string> sent;
+        for (int i = 0; i < 20; ++i, ++n)
+        {
+            sent.push_back("DATAGRAM" + std::to_string(n));
+            socket->SendTo(serverAddr, sent.back());
+        }
+        std::vector<std::string> received;
+        for (int i = 0; i < 20; ++i)
+        {
+            auto data = socket->RecvFrom(serverAddr, 64);
+            received.push_back(std::string(data.begin(), data.end()));
+        }
+        // one flow stays on one worker and keeps its order
+        if (!ordered)
+        {
+            std::sort(sent.begin(), sent.end());
+            std::sort(received.begin(), received.end());
+        }
+        REQUIRE(received == sent);
+    }
+
+    REQUIRE(handled.load() == n);
+    REQUIRE(server->GetDroppedTasks() == 0);
+
+    server->Stop();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    REQUIRE(!server->IsListening());
+}
+
+TEST_CASE("should read dropped tasks while the server restarts", "[udp-server]")
+{
+    class Handler : public UdpDatagramHandler
+    {
+    public:
+        virtual void HandleDatagram() {}
+    };
+
+    auto server = UdpServer::Create([] { return std::make_shared<Handler>(); });
+    server->SetThreadPoolSize(1);
+    std::atomic<bool> done(false);
+    std::thread reader([server, &done] {
+        while (!done.load())
+            server->GetDroppedTasks();
+    });
+
+    for (int i = 0; i < 3; ++i)
+    {
+        uint16_t port = RandomPort();
+        std::thread serverThread([server, port] {
+            server->Listen(port);
+        });
+        for (int j = 0; j < 100 && !server->IsListening(); ++j)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        auto socket = Socket::Create(SOCK_DGRAM);
+        socket->SendTo(std::make_shared<Address>(port), "PING");
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        server->Stop();
+        serverThread.join();
+    }
+    done = true;
+    reader.join();
+    REQUIRE(server->GetDroppedTasks() == 0);
 }
\ No newline at end of file